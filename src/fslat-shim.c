@@ -0,0 +1,266 @@
+/*
+ * fslat-shim
+ * Latency injection for benchmarking ls on slow (NFS-like) filesystems
+ *
+ * Test-only. Built by `make fslat` into bin/fslat.so and loaded with
+ * LD_PRELOAD:
+ *
+ *     FSLAT_STAT_US=200 FSLAT_JITTER_US=100 FSLAT_REPORT=counts \
+ *         LD_PRELOAD=bin/fslat.so bin/ls -lR /usr/include
+ *
+ * Features:
+ *  - Wraps opendir/fdopendir, readdir/readdir64 and getdents64, the stat
+ *    family (stat, lstat, fstatat and their 64-bit variants, statx, and
+ *    the __xstat entry points of binaries built against older glibc) and
+ *    the user/group lookups (getpwuid[_r], getgrgid[_r]).
+ *  - Each wrapped call sleeps for its class's latency plus a uniformly
+ *    random jitter before calling the real function. Latencies are in
+ *    microseconds: FSLAT_US for every class, overridden per class by
+ *    FSLAT_OPENDIR_US, FSLAT_GETDENTS_US, FSLAT_STAT_US and
+ *    FSLAT_GETPWUID_US (user and group lookups); FSLAT_JITTER_US adds
+ *    0..N more.
+ *  - Calls are counted per class and written at exit to FSLAT_REPORT
+ *    (appended), or to stderr, one "class count" line each, so a test
+ *    can check syscall budgets per listed entry.
+ *
+ * Notes:
+ *  - glibc's readdir() calls getdents64 internally, which cannot be
+ *    interposed. A directory read is counted as one getdents64 call when
+ *    readdir() starts a new buffer: the first call on a DIR, a returned
+ *    entry that lies before the previous one (the buffer was refilled),
+ *    or the end of the directory (the last, empty getdents64).
+ *  - fstat() is not wrapped: it does not touch the directory tree.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* classes of wrapped calls: each has its own latency and counter */
+typedef enum { LAT_OPENDIR, LAT_GETDENTS, LAT_STAT, LAT_GETPWUID, LAT_COUNT } lat_class_t;
+
+static const char *const class_name[LAT_COUNT] = { "opendir", "getdents64", "stat", "getpwuid" };
+static const char *const class_env[LAT_COUNT] = {
+    "FSLAT_OPENDIR_US", "FSLAT_GETDENTS_US", "FSLAT_STAT_US", "FSLAT_GETPWUID_US"
+};
+
+static long latency_us[LAT_COUNT];
+static long jitter_us;
+static unsigned long long calls[LAT_COUNT];
+
+/* readdir() batch detection, per thread */
+static __thread DIR *last_dir;
+static __thread const void *last_entry;
+static __thread unsigned int jitter_seed;
+
+/* look up the next definition of a symbol once; the wrappers below share this */
+#define REAL(name) \
+    static __typeof__(&name) real_##name; \
+    if (!real_##name) real_##name = (__typeof__(&name))dlsym(RTLD_NEXT, #name)
+
+/* no longer declared by glibc >= 2.33 headers */
+int __xstat(int ver, const char *path, struct stat *st);
+int __lxstat(int ver, const char *path, struct stat *st);
+int __fxstatat(int ver, int dfd, const char *path, struct stat *st, int flags);
+
+static long env_us(const char *name, long fallback)
+{
+    const char *v = getenv(name);
+    if (!v || !*v) return fallback;
+    char *end;
+    long us = strtol(v, &end, 10);
+    return (*end == '\0' && us >= 0) ? us : fallback;
+}
+
+__attribute__((constructor)) static void fslat_init(void)
+{
+    long all = env_us("FSLAT_US", 0);
+    for (int c = 0; c < LAT_COUNT; ++c) latency_us[c] = env_us(class_env[c], all);
+    jitter_us = env_us("FSLAT_JITTER_US", 0);
+}
+
+__attribute__((destructor)) static void fslat_report(void)
+{
+    const char *file = getenv("FSLAT_REPORT");
+    FILE *fp = file && *file ? fopen(file, "a") : NULL;
+    for (int c = 0; c < LAT_COUNT; ++c)
+        fprintf(fp ? fp : stderr, "%s %llu\n", class_name[c], __atomic_load_n(&calls[c], __ATOMIC_RELAXED));
+    if (fp) fclose(fp);
+}
+
+/* count one call of class c and sleep for its latency */
+static void delay(lat_class_t c)
+{
+    __atomic_add_fetch(&calls[c], 1, __ATOMIC_RELAXED);
+    long us = latency_us[c];
+    if (jitter_us > 0)
+    {
+        if (jitter_seed == 0) jitter_seed = (unsigned int)(uintptr_t)&jitter_seed ^ (unsigned int)time(NULL);
+        us += (long)(rand_r(&jitter_seed) % (jitter_us + 1));
+    }
+    if (us <= 0) return;
+    struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) { }
+}
+
+/* ---------- directories ---------- */
+
+DIR *opendir(const char *name)
+{
+    REAL(opendir);
+    delay(LAT_OPENDIR);
+    return real_opendir(name);
+}
+
+DIR *fdopendir(int fd)
+{
+    REAL(fdopendir);
+    delay(LAT_OPENDIR);
+    return real_fdopendir(fd);
+}
+
+/* a new readdir() buffer means glibc issued getdents64 */
+static void readdir_batch(DIR *dp, const void *entry)
+{
+    if (dp != last_dir || !entry || (const char *)entry <= (const char *)last_entry)
+        delay(LAT_GETDENTS);
+    last_dir = entry ? dp : NULL;
+    last_entry = entry;
+}
+
+struct dirent *readdir(DIR *dp)
+{
+    REAL(readdir);
+    struct dirent *entry = real_readdir(dp);
+    readdir_batch(dp, entry);
+    return entry;
+}
+
+struct dirent64 *readdir64(DIR *dp)
+{
+    REAL(readdir64);
+    struct dirent64 *entry = real_readdir64(dp);
+    readdir_batch(dp, entry);
+    return entry;
+}
+
+ssize_t getdents64(int fd, void *buf, size_t nbytes)
+{
+    REAL(getdents64);
+    delay(LAT_GETDENTS);
+    return real_getdents64(fd, buf, nbytes);
+}
+
+/* ---------- stat family ---------- */
+
+int stat(const char *path, struct stat *st)
+{
+    REAL(stat);
+    delay(LAT_STAT);
+    return real_stat(path, st);
+}
+
+int lstat(const char *path, struct stat *st)
+{
+    REAL(lstat);
+    delay(LAT_STAT);
+    return real_lstat(path, st);
+}
+
+int fstatat(int dfd, const char *path, struct stat *st, int flags)
+{
+    REAL(fstatat);
+    delay(LAT_STAT);
+    return real_fstatat(dfd, path, st, flags);
+}
+
+int stat64(const char *path, struct stat64 *st)
+{
+    REAL(stat64);
+    delay(LAT_STAT);
+    return real_stat64(path, st);
+}
+
+int lstat64(const char *path, struct stat64 *st)
+{
+    REAL(lstat64);
+    delay(LAT_STAT);
+    return real_lstat64(path, st);
+}
+
+int fstatat64(int dfd, const char *path, struct stat64 *st, int flags)
+{
+    REAL(fstatat64);
+    delay(LAT_STAT);
+    return real_fstatat64(dfd, path, st, flags);
+}
+
+int statx(int dfd, const char *path, int flags, unsigned int mask, struct statx *stx)
+{
+    REAL(statx);
+    delay(LAT_STAT);
+    return real_statx(dfd, path, flags, mask, stx);
+}
+
+/* binaries built against glibc < 2.33 call these instead */
+int __xstat(int ver, const char *path, struct stat *st)
+{
+    REAL(__xstat);
+    delay(LAT_STAT);
+    return real___xstat(ver, path, st);
+}
+
+int __lxstat(int ver, const char *path, struct stat *st)
+{
+    REAL(__lxstat);
+    delay(LAT_STAT);
+    return real___lxstat(ver, path, st);
+}
+
+int __fxstatat(int ver, int dfd, const char *path, struct stat *st, int flags)
+{
+    REAL(__fxstatat);
+    delay(LAT_STAT);
+    return real___fxstatat(ver, dfd, path, st, flags);
+}
+
+/* ---------- user and group lookups ---------- */
+
+struct passwd *getpwuid(uid_t uid)
+{
+    REAL(getpwuid);
+    delay(LAT_GETPWUID);
+    return real_getpwuid(uid);
+}
+
+int getpwuid_r(uid_t uid, struct passwd *pwd, char *buf, size_t len, struct passwd **result)
+{
+    REAL(getpwuid_r);
+    delay(LAT_GETPWUID);
+    return real_getpwuid_r(uid, pwd, buf, len, result);
+}
+
+struct group *getgrgid(gid_t gid)
+{
+    REAL(getgrgid);
+    delay(LAT_GETPWUID);
+    return real_getgrgid(gid);
+}
+
+int getgrgid_r(gid_t gid, struct group *grp, char *buf, size_t len, struct group **result)
+{
+    REAL(getgrgid_r);
+    delay(LAT_GETPWUID);
+    return real_getgrgid_r(gid, grp, buf, len, result);
+}
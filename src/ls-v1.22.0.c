@@ -0,0 +1,3983 @@
+/*
+ * ls-v1.22.0
+ * Version 1.22.0 — Snapshots (--snapshot, --diff)
+ *
+ * Features:
+ *  - Recursive traversal with -R
+ *  - --top K [--by size|mtime]: walks the whole tree under each directory
+ *    and prints only the K largest (or most recently modified) files.
+ *    Every worker thread keeps a bounded min-heap of K entries; the heaps
+ *    are merged at the end, so the cost is O(n log K) time and O(K) memory
+ *    per worker instead of sorting every entry.
+ *  - -t (newest first), -S (largest first), -r (reverse any order).
+ *    Entries are stat()ed once into a cache; the sort stage builds packed
+ *    (key, index) records from it and sorts them with a stable merge sort
+ *    that splits across all cores on large directories. Ties fall back to
+ *    name order.
+ *  - Several directory operands are read, stat()ed and formatted
+ *    concurrently by a pool of workers, each into its own memory buffer.
+ *    The main thread prints the buffers strictly in operand order, so the
+ *    output (blank-line separators included) is byte-identical to a
+ *    sequential run. At most OPERAND_WINDOW operands are in flight.
+ *  - Directory contents live in a structure-of-arrays entry table: one
+ *    string pool plus dense arrays of name offsets, uint16 lengths,
+ *    display widths, d_type and mode bits. Layout passes read the cached
+ *    widths instead of calling strlen() per cell, and d_type answers the
+ *    coloring and recursion questions without a stat where it can.
+ *  - Display widths come from a width/escaping stage: names are scanned
+ *    16 or 32 bytes at a time (SSE2/AVX2) and pure printable ASCII names
+ *    get width == length; only the rest are decoded with mbrtowc() and
+ *    wcwidth(). On a terminal, control characters and invalid bytes are
+ *    printed as '?'. The width is cached in the entry table.
+ *  - -L follows symbolic links: entries are described by their targets
+ *    and symlinked directories are descended into. A (dev, ino) open
+ *    addressing set remembers every directory already read, so cycles and
+ *    subtrees reachable through several links are listed only once.
+ *  - --one-file-system keeps recursion on the device of each operand, and
+ *    --skip-fs-type=TYPE[,TYPE...] (e.g. proc,sysfs,nfs) prunes any
+ *    directory on a filesystem of those types. Types come from one read of
+ *    /proc/self/mountinfo at startup; subtrees are pruned before opendir.
+ *  - --exclude-from=FILE reads gitignore-style patterns, and --gitignore
+ *    also honours .gitignore files found while walking. Patterns are
+ *    compiled once (literal / suffix / glob) into a chain of per-directory
+ *    rule sets; excluded entries are dropped as the directory is read, so
+ *    excluded directories are never opened.
+ *  - Leaf optimization: a directory's st_nlink - 2 is its number of
+ *    subdirectories on traditional filesystems, so -R stops looking for
+ *    subdirectories (and stat()ing entries without d_type) once that many
+ *    were found. Turned off on btrfs, NFS, CIFS/SMB, FUSE and overlayfs,
+ *    and with -L. --color=never|auto skips the stats made only for
+ *    coloring; the default stays "always".
+ *  - The metadata stage stats a directory's entries in d_ino order (kept
+ *    from readdir), which walks the inode table sequentially on ext4/xfs
+ *    instead of seeking for every name; the name sort runs afterwards.
+ *  - Output errors stop the scan: once a write to stdout fails (EPIPE
+ *    when the reader, e.g. `head`, has exited) traversal is cancelled at
+ *    the next directory. --max-entries N stops reading, stat()ing and
+ *    recursing once N entries have been listed.
+ *  - --from-file=PATH|- reads directory operands from a file or stdin
+ *    instead of argv, separated by NUL or newline (whichever comes first
+ *    decides). Operands are pulled from the stream by the concurrent
+ *    operand workers, so one process serves any number of directories and
+ *    each listing is written out (and flushed) as soon as it and all
+ *    earlier ones are done.
+ *  - --summary walks each tree with the parallel walker and prints
+ *    aggregate statistics instead of a listing: entry counts and bytes
+ *    per type (the same classes the colors are chosen from), bytes per
+ *    owner and per group, a log2 histogram of regular file sizes and the
+ *    most common extensions. Every worker fills its own accumulator; they
+ *    are merged once the walk is over.
+ *  - -l --checksum adds an XXH64 content hash column (bundled, no
+ *    library needed). Regular files are hashed by a per-directory thread
+ *    pool under a global bytes-in-flight limit; small files are read()
+ *    with POSIX_FADV_SEQUENTIAL, large ones mmap()ed in 16 MiB windows.
+ *    Hashes are cached by (dev, ino, size, mtime) in
+ *    $XDG_CACHE_HOME/ls-checksums, so unchanged files are not read again.
+ *  - --duplicates reports groups of identical regular files. Candidates
+ *    are grouped by size from the walker's stat data, then by a hash of
+ *    their first and last 4 KiB, and only then hashed in full (through
+ *    the --checksum cache); files with a unique size are never opened.
+ *    Hardlinks are recognized by (dev, ino) and hashed once.
+ *  - --snapshot=FILE writes the recursive listing of one directory as a
+ *    compact binary stream (path, type, mode, size, ino, mtime; paths
+ *    prefix-compressed) in component-wise sorted order. --diff=OLD NEW
+ *    compares two snapshots, or a snapshot and a live directory, in one
+ *    merge-join pass and prints added (+), removed (-) and changed (~)
+ *    entries. Memory is bounded by the directory depth, not the tree size.
+ *  - Integrates with existing display modes:
+ *      - default: down-then-across (columns)
+ *      - -x: horizontal (row-major)
+ *      - -l: long listing (colorized names included)
+ *  - Alphabetical (case-insensitive) sorting
+ *  - Colorized output based on file type (same rules as v1.5.0)
+ *
+ * Notes:
+ *  - Skips entries starting with '.' (hidden) — unchanged behavior.
+ *  - Does NOT descend into '.' or '..'; symlinked directories only with -L.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <locale.h>
+#include <wchar.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+extern int errno;
+
+/* display modes */
+typedef enum { MODE_DEFAULT, MODE_LONG, MODE_HORIZONTAL } display_mode_t;
+
+/* sort keys */
+typedef enum { SORT_NAME, SORT_TIME, SORT_SIZE } sort_key_t;
+
+static sort_key_t sort_key = SORT_NAME;
+static int reverse_flag = 0;
+static int follow_links = 0;     /* -L */
+static int one_file_system = 0;  /* --one-file-system */
+
+/* mounted filesystems from /proc/self/mountinfo (--skip-fs-type) */
+struct mount_entry
+{
+    dev_t dev;
+    char *fstype;
+};
+
+static struct mount_entry *mounts = NULL;
+static size_t mount_count = 0;
+static char **skip_fs_types = NULL;   /* NULL-terminated */
+
+/* one compiled exclude pattern */
+#define IGN_NEGATE   0x01        /* "!pat": re-include */
+#define IGN_DIR_ONLY 0x02        /* "pat/": directories only */
+#define IGN_ANCHORED 0x04        /* contains '/': matched against the relative path */
+#define IGN_LITERAL  0x08        /* no wildcards: plain compare */
+#define IGN_SUFFIX   0x10        /* "*literal": suffix compare */
+
+struct ignore_rule
+{
+    char *pat;
+    size_t len;
+    unsigned flags;
+};
+
+/*
+ * Rules that apply below one directory. Nodes form a chain towards the
+ * operand root; a lookup walks from the deepest node up and, within a
+ * node, from the last rule back, so later and deeper rules win as in git.
+ * Nodes are reference counted because walker threads share them.
+ */
+struct ignore_node
+{
+    struct ignore_node *parent;
+    char *base;                  /* directory the patterns are relative to */
+    size_t base_len;
+    struct ignore_rule *rules;
+    size_t nrules;
+    int owns_rules;
+    int refs;
+};
+
+static struct ignore_rule *exclude_rules = NULL;   /* --exclude-from */
+static size_t exclude_count = 0;
+static int use_gitignore = 0;                      /* --gitignore */
+
+/* directories smaller than this are sorted on the calling thread */
+#define PAR_SORT_MIN 32768
+
+/* operands rendered ahead of the one being printed */
+#define OPERAND_WINDOW 64
+/* operand workers are I/O bound, so use at least this many */
+#define OPERAND_THREADS_MIN 8
+
+/* listing output of the current thread: stdout, or an operand buffer */
+static __thread FILE *out_fp;
+
+/*
+ * Directory contents, one dense array per field. Names are stored back to
+ * back (NUL-terminated) in a single pool and addressed by offset, so the
+ * pool can grow without invalidating anything. mode[] is only meaningful
+ * where has_stat[] is set; st[] is the optional full stat cache used by
+ * the long listing and the time/size sorts.
+ */
+struct entry_table
+{
+    char *pool;
+    size_t pool_len, pool_cap;
+    uint32_t *name_off;
+    uint16_t *name_len;
+    uint16_t *width;             /* display columns */
+    unsigned char *name_flags;   /* NAME_PLAIN */
+    unsigned char *d_type;
+    ino_t *ino;                  /* d_ino from readdir */
+    mode_t *mode;
+    unsigned char *has_stat;
+    struct stat *st;
+    uint64_t *sum;               /* --checksum, filled after sorting */
+    unsigned char *sum_state;    /* SUM_* */
+    size_t count, cap;
+    size_t maxwidth;
+    nlink_t dir_nlink;           /* links of the directory itself */
+    int nlink_reliable;          /* dir_nlink - 2 == number of subdirectories */
+};
+
+#define ENT_NAME(t, i) ((t)->pool + (t)->name_off[i])
+
+/* checksum column state of an entry */
+#define SUM_NONE   0             /* not a regular file */
+#define SUM_OK     1
+#define SUM_FAILED 2
+
+/* name is printable ASCII: prints as is, width == length */
+#define NAME_PLAIN 0x01
+
+/* replace unprintable characters with '?' (on when stdout is a terminal) */
+static int escape_names = 0;
+
+/* color names by type (--color; on by default) */
+static int color_enabled = 1;
+
+/* set once stdout fails; every traversal loop checks it */
+static int scan_cancelled = 0;
+
+/* -l --checksum: content hash column */
+static int checksum_flag = 0;
+
+/* --max-entries: entries still allowed (ignored while max_entries < 0) */
+static long long max_entries = -1;
+static long long entries_left = 0;
+
+/*
+ * Set of (dev, ino) pairs of directories already read. Open addressing
+ * with linear probing; (0, 0) marks an empty slot. Kept at most half full.
+ */
+struct visited_set
+{
+    dev_t *dev;
+    ino_t *ino;
+    size_t count, cap;           /* cap is a power of two */
+};
+
+/* visited set of the -L listing running on this thread */
+static __thread struct visited_set *visited;
+
+/* nesting of process_dir_recursive on this thread, and its operand's device */
+static __thread int recursion_depth;
+static __thread dev_t root_dev;
+
+/* exclude rules in effect for the directory being listed on this thread */
+static __thread struct ignore_node *ignore_cur;
+
+/* where directory operands come from: argv, or a --from-file stream */
+struct operand_source
+{
+    char **argv;
+    size_t argc, pos;
+    FILE *fp;                    /* NULL: use argv */
+    int sep;                     /* '\0' or '\n'; -1 until the first one is read */
+};
+
+/* ANSI color codes */
+#define CLR_RESET    "\033[0m"
+#define CLR_BLUE     "\033[0;34m"
+#define CLR_GREEN    "\033[0;32m"
+#define CLR_RED      "\033[0;31m"
+#define CLR_MAGENTA  "\033[0;35m"
+#define CLR_REVERSE  "\033[7m"
+
+/* file classes that pick the color */
+typedef enum { CLS_PLAIN, CLS_LINK, CLS_DIR, CLS_SPECIAL, CLS_ARCHIVE, CLS_EXEC, CLS_COUNT } name_class_t;
+
+static const char *const class_color[CLS_COUNT] = {
+    "", CLR_MAGENTA, CLR_BLUE, CLR_REVERSE, CLR_RED, CLR_GREEN
+};
+
+static const char *const class_label[CLS_COUNT] = {
+    "regular", "symlink", "directory", "special", "archive", "executable"
+};
+
+/* Prototypes */
+static int get_terminal_width(void);
+static int read_dir_entries(const char *dir, struct entry_table *t, const struct ignore_node *ign);
+static int nlink_counts_subdirs(int fd, dev_t dev);
+static void table_free(struct entry_table *t);
+static int is_archive_name(const char *name);
+static name_class_t classify_name(const char *name, mode_t mode);
+static void init_name_scan(void);
+static void measure_entries(struct entry_table *t);
+static void print_name_colored(const char *name, mode_t mode, int pad, int plain);
+static void print_entry_with_pad(const char *dir, struct entry_table *t, size_t i, int pad);
+static void display_down_across(struct entry_table *t, int term_width, const char *dir);
+static void display_horizontal(struct entry_table *t, int term_width, const char *dir);
+static void display_long(const char *dir, struct entry_table *t);
+static void print_long_format(const char *path, const char *filename, const struct stat *cached, int plain,
+                              const char *sum);
+static void print_permissions(mode_t mode);
+static int default_thread_count(void);
+static int run_top_k(char **dirs, size_t ndirs, size_t k, int by_mtime);
+static int run_summary(char **dirs, size_t ndirs);
+static int run_duplicates(char **dirs, size_t ndirs);
+static int run_snapshot(const char *dir, const char *file);
+static int run_diff(const char *old_path, const char *new_path);
+static void parallel_merge_sort(void *base, size_t n, size_t size, int (*cmp)(const void *, const void *));
+static void stat_entries(const char *dir, struct entry_table *t);
+static void sort_entries(struct entry_table *t);
+static void checksum_entries(const char *dir, struct entry_table *t);
+static void hash_cache_save(void);
+static int stat_at(int dfd, const char *name, const char *path, struct stat *st);
+static struct visited_set *visited_new(void);
+static void visited_free(struct visited_set *v);
+static int visited_insert(struct visited_set *v, dev_t dev, ino_t ino);
+static int parse_skip_fs_types(const char *list);
+static int load_mountinfo(void);
+static int prune_dir(const struct stat *st, dev_t top_dev);
+static int load_exclude_file(const char *file);
+static struct ignore_node *ignore_enter(const char *dir, struct ignore_node *parent);
+static void ignore_unref(struct ignore_node *node);
+static int ignore_match(const struct ignore_node *node, const char *dir, const char *name, int is_dir);
+static char *operand_next(struct operand_source *src);
+static char **operand_collect(struct operand_source *src, size_t *n);
+static int run_operands_concurrent(struct operand_source *src, display_mode_t mode, int recursive);
+static int take_entry(void);
+static int scan_stopped(void);
+static void check_output(void);
+static int finish_output(const char *prog);
+
+/* comparison for qsort (case-insensitive) */
+static int cmpstring_ci(const void *a, const void *b)
+{
+    char *s1 = *(char **)a;
+    char *s2 = *(char **)b;
+    int r = strcasecmp(s1, s2);
+    return r != 0 ? r : strcmp(s1, s2);
+}
+
+/* long-only options */
+enum { OPT_TOP = 256, OPT_BY, OPT_ONE_FS, OPT_SKIP_FS, OPT_EXCLUDE_FROM, OPT_GITIGNORE, OPT_COLOR,
+       OPT_MAX_ENTRIES, OPT_FROM_FILE, OPT_SUMMARY,
+       OPT_CHECKSUM, OPT_DUPLICATES, OPT_SNAPSHOT, OPT_DIFF };
+
+static const struct option long_options[] = {
+    { "top", required_argument, NULL, OPT_TOP },
+    { "by",  required_argument, NULL, OPT_BY  },
+    { "one-file-system", no_argument, NULL, OPT_ONE_FS },
+    { "skip-fs-type", required_argument, NULL, OPT_SKIP_FS },
+    { "exclude-from", required_argument, NULL, OPT_EXCLUDE_FROM },
+    { "gitignore", no_argument, NULL, OPT_GITIGNORE },
+    { "color", optional_argument, NULL, OPT_COLOR },
+    { "max-entries", required_argument, NULL, OPT_MAX_ENTRIES },
+    { "from-file", required_argument, NULL, OPT_FROM_FILE },
+    { "summary", no_argument, NULL, OPT_SUMMARY },
+    { "checksum", no_argument, NULL, OPT_CHECKSUM },
+    { "duplicates", no_argument, NULL, OPT_DUPLICATES },
+    { "snapshot", required_argument, NULL, OPT_SNAPSHOT },
+    { "diff", required_argument, NULL, OPT_DIFF },
+    { NULL, 0, NULL, 0 }
+};
+
+/* ---------- main ---------- */
+int main(int argc, char *argv[])
+{
+    int opt;
+    display_mode_t mode = MODE_DEFAULT;
+    int recursive_flag = 0;
+    size_t top_k = 0;
+    int top_by_mtime = 0;
+    const char *from_file = NULL;
+    int summary_flag = 0;
+    int duplicates_flag = 0;
+    const char *snapshot_file = NULL;
+    const char *diff_old = NULL;
+
+    out_fp = stdout;
+    setlocale(LC_CTYPE, "");
+    escape_names = isatty(STDOUT_FILENO);
+    init_name_scan();
+
+    /* parse options -l -x -R -t -S -r and the long options */
+    while ((opt = getopt_long(argc, argv, "lxRtSrL", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'l': mode = MODE_LONG; break;
+            case 'x': mode = MODE_HORIZONTAL; break;
+            case 'R': recursive_flag = 1; break;
+            case 't': sort_key = SORT_TIME; break;
+            case 'S': sort_key = SORT_SIZE; break;
+            case 'r': reverse_flag = 1; break;
+            case 'L': follow_links = 1; break;
+            case OPT_TOP:
+            {
+                char *end;
+                errno = 0;
+                unsigned long long k = strtoull(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || k == 0 || optarg[0] == '-')
+                {
+                    fprintf(stderr, "%s: invalid --top value: %s\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                top_k = (size_t)k;
+                break;
+            }
+            case OPT_BY:
+                if (strcmp(optarg, "size") == 0) top_by_mtime = 0;
+                else if (strcmp(optarg, "mtime") == 0) top_by_mtime = 1;
+                else
+                {
+                    fprintf(stderr, "%s: --by must be 'size' or 'mtime'\n", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_ONE_FS: one_file_system = 1; break;
+            case OPT_SKIP_FS:
+                if (parse_skip_fs_types(optarg) == -1)
+                {
+                    fprintf(stderr, "%s: invalid --skip-fs-type list: %s\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_EXCLUDE_FROM:
+                if (load_exclude_file(optarg) == -1)
+                {
+                    fprintf(stderr, "%s: cannot read exclude file: %s\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_GITIGNORE: use_gitignore = 1; break;
+            case OPT_COLOR:
+                if (!optarg || strcmp(optarg, "always") == 0) color_enabled = 1;
+                else if (strcmp(optarg, "never") == 0) color_enabled = 0;
+                else if (strcmp(optarg, "auto") == 0) color_enabled = isatty(STDOUT_FILENO);
+                else
+                {
+                    fprintf(stderr, "%s: --color must be 'always', 'never' or 'auto'\n", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_MAX_ENTRIES:
+            {
+                char *end;
+                errno = 0;
+                long long n = strtoll(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || n < 0)
+                {
+                    fprintf(stderr, "%s: invalid --max-entries value: %s\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                max_entries = entries_left = n;
+                break;
+            }
+            case OPT_FROM_FILE: from_file = optarg; break;
+            case OPT_SUMMARY: summary_flag = 1; break;
+            case OPT_CHECKSUM: checksum_flag = 1; break;
+            case OPT_DUPLICATES: duplicates_flag = 1; break;
+            case OPT_SNAPSHOT: snapshot_file = optarg; break;
+            case OPT_DIFF: diff_old = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-l] [-x] [-R] [-t|-S] [-r] [-L] [--one-file-system]"
+                        " [--skip-fs-type=TYPE,...] [--exclude-from=FILE] [--gitignore] [--color[=WHEN]]"
+                        " [--max-entries=N] [--from-file=PATH|-] [--checksum]"
+                        " [--top K [--by size|mtime] | --summary | --duplicates |"
+                        " --snapshot=FILE | --diff=OLD] [directory...]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (checksum_flag && mode != MODE_LONG)
+    {
+        fprintf(stderr, "%s: --checksum requires -l\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    /* read the mount table once, before any thread starts */
+    if (skip_fs_types && load_mountinfo() == -1)
+        fprintf(stderr, "%s: cannot read /proc/self/mountinfo; --skip-fs-type ignored\n", argv[0]);
+
+    /* operands come from argv ("." if none) or from the --from-file stream */
+    static char *dot[] = { "." };
+    struct operand_source src = { dot, 1, 0, NULL, -1 };
+    if (from_file)
+    {
+        if (optind < argc)
+        {
+            fprintf(stderr, "%s: directory operands cannot be combined with --from-file\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        src.fp = strcmp(from_file, "-") == 0 ? stdin : fopen(from_file, "r");
+        if (!src.fp)
+        {
+            fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], from_file, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (optind < argc)
+    {
+        src.argv = argv + optind;
+        src.argc = (size_t)(argc - optind);
+    }
+    int rc = 0;
+    /* snapshot modes take exactly one tree (or snapshot) operand */
+    if (snapshot_file || diff_old)
+    {
+        size_t n;
+        char **dirs = operand_collect(&src, &n);
+        if (!dirs || n > 1)
+        {
+            fprintf(stderr, "%s: --snapshot and --diff take a single operand\n", argv[0]);
+            rc = 2;
+        }
+        else if (snapshot_file) rc = run_snapshot(n ? dirs[0] : ".", snapshot_file);
+        else rc = run_diff(diff_old, n ? dirs[0] : ".");
+        for (size_t i = 0; dirs && i < n; ++i) free(dirs[i]);
+        free(dirs);
+    }
+    /* whole-tree modes replace the normal listing for all operands */
+    else if (top_k > 0 || summary_flag || duplicates_flag)
+    {
+        size_t n;
+        char **dirs = operand_collect(&src, &n);
+        if (dirs && top_k > 0) rc = run_top_k(dirs, n, top_k, top_by_mtime);
+        else if (dirs && summary_flag) rc = run_summary(dirs, n);
+        else if (dirs) rc = run_duplicates(dirs, n);
+        else rc = 1;
+        for (size_t i = 0; dirs && i < n; ++i) free(dirs[i]);
+        free(dirs);
+    }
+    else
+    {
+        extern void process_dir_recursive(const char *dir, display_mode_t mode, int recursive);
+        /* an entry budget must be spent in operand order, so no concurrency then */
+        if ((!src.fp && src.argc == 1) || max_entries >= 0 ||
+            run_operands_concurrent(&src, mode, recursive_flag) == -1)
+        {
+            char *dir;
+            for (size_t seq = 0; !scan_stopped() && (dir = operand_next(&src)) != NULL; ++seq)
+            {
+                if (seq > 0) fputc('\n', out_fp);
+                process_dir_recursive(dir, mode, recursive_flag);
+                free(dir);
+                check_output();
+            }
+        }
+    }
+    if (checksum_flag) hash_cache_save();
+    if (src.fp)
+    {
+        if (ferror(src.fp))
+        {
+            fprintf(stderr, "%s: error reading %s\n", argv[0], from_file);
+            rc = 1;
+        }
+        if (src.fp != stdin) fclose(src.fp);
+    }
+    /* --diff keeps diff(1)'s statuses: trouble is 2 there */
+    if (finish_output(argv[0])) return diff_old ? 2 : 1;
+    return rc;
+}
+
+/* ---------- helpers ---------- */
+
+/* claim one entry from the --max-entries budget; 0 when it is spent */
+static int take_entry(void)
+{
+    if (max_entries < 0) return 1;
+    return __atomic_sub_fetch(&entries_left, 1, __ATOMIC_RELAXED) >= 0;
+}
+
+/* 1 once traversal must stop: output failed or the entry budget is spent */
+static int scan_stopped(void)
+{
+    if (__atomic_load_n(&scan_cancelled, __ATOMIC_RELAXED)) return 1;
+    return max_entries >= 0 && __atomic_load_n(&entries_left, __ATOMIC_RELAXED) <= 0;
+}
+
+/*
+ * cancel traversal if stdout has failed. Only the thread that writes to
+ * stdout can see the error; buffered operand workers notice the flag.
+ */
+static void check_output(void)
+{
+    if (out_fp == stdout && ferror(stdout))
+        __atomic_store_n(&scan_cancelled, 1, __ATOMIC_RELAXED);
+}
+
+/* flush stdout and report a write error (quietly for a closed pipe) */
+static int finish_output(const char *prog)
+{
+    if (fflush(stdout) == 0 && !ferror(stdout)) return 0;
+    if (errno != EPIPE) fprintf(stderr, "%s: write error: %s\n", prog, strerror(errno));
+    return 1;
+}
+
+static int get_terminal_width(void)
+{
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) return 80;
+    return (int)ws.ws_col;
+}
+
+/* grow every column to hold at least need entries */
+static int table_reserve(struct entry_table *t, size_t need)
+{
+    if (need <= t->cap) return 0;
+    size_t cap = t->cap ? t->cap : 64;
+    while (cap < need) cap *= 2;
+    uint32_t *off = realloc(t->name_off, cap * sizeof(*off));
+    if (off) t->name_off = off;
+    uint16_t *len = realloc(t->name_len, cap * sizeof(*len));
+    if (len) t->name_len = len;
+    uint16_t *wid = realloc(t->width, cap * sizeof(*wid));
+    if (wid) t->width = wid;
+    unsigned char *nf = realloc(t->name_flags, cap);
+    if (nf) t->name_flags = nf;
+    unsigned char *dt = realloc(t->d_type, cap);
+    if (dt) t->d_type = dt;
+    ino_t *in = realloc(t->ino, cap * sizeof(*in));
+    if (in) t->ino = in;
+    mode_t *md = realloc(t->mode, cap * sizeof(*md));
+    if (md) t->mode = md;
+    unsigned char *hs = realloc(t->has_stat, cap);
+    if (hs) t->has_stat = hs;
+    if (!off || !len || !wid || !nf || !dt || !in || !md || !hs) return -1;
+    t->cap = cap;
+    return 0;
+}
+
+static int table_push(struct entry_table *t, const char *name, unsigned char d_type, ino_t ino)
+{
+    size_t len = strlen(name);
+    if (t->count >= t->cap && table_reserve(t, t->count + 1) == -1) return -1;
+    if (t->pool_len + len + 1 > t->pool_cap)
+    {
+        size_t cap = t->pool_cap ? t->pool_cap : 4096;
+        while (t->pool_len + len + 1 > cap) cap *= 2;
+        if (cap > UINT32_MAX) return -1;
+        char *pool = realloc(t->pool, cap);
+        if (!pool) return -1;
+        t->pool = pool;
+        t->pool_cap = cap;
+    }
+    memcpy(t->pool + t->pool_len, name, len + 1);
+
+    size_t i = t->count++;
+    t->name_off[i] = (uint32_t)t->pool_len;
+    t->name_len[i] = (uint16_t)len;
+    t->d_type[i] = d_type;
+    t->ino[i] = ino;
+    t->has_stat[i] = 0;
+    t->pool_len += len + 1;
+    return 0;
+}
+
+/* read entries into the table, skip hidden and excluded files */
+static int read_dir_entries(const char *dir, struct entry_table *t, const struct ignore_node *ign)
+{
+    memset(t, 0, sizeof(*t));
+    DIR *dp = opendir(dir);
+    if (!dp) return -1;
+
+    struct stat dst;
+    if (fstat(dirfd(dp), &dst) == 0)
+    {
+        t->dir_nlink = dst.st_nlink;
+        t->nlink_reliable = dst.st_nlink >= 2 && nlink_counts_subdirs(dirfd(dp), dst.st_dev);
+    }
+    errno = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL)
+    {
+        /* Skip hidden files (.). If you later implement -a, change this. */
+        if (entry->d_name[0] == '.') continue;
+
+        /* with -L a link's d_type says nothing about its target */
+        unsigned char dt = entry->d_type;
+        if (follow_links && dt == DT_LNK) dt = DT_UNKNOWN;
+
+        if (ign)
+        {
+            int is_dir = dt == DT_DIR;
+            if (dt == DT_UNKNOWN)
+            {
+                struct stat st;
+                is_dir = stat_at(dirfd(dp), entry->d_name, NULL, &st) == 0 && S_ISDIR(st.st_mode);
+            }
+            if (ignore_match(ign, dir, entry->d_name, is_dir)) continue;
+        }
+
+        /* --max-entries: stop reading once the budget is spent */
+        if (!take_entry()) break;
+
+        if (table_push(t, entry->d_name, dt, entry->d_ino) == -1)
+        {
+            table_free(t);
+            closedir(dp);
+            return -1;
+        }
+    }
+    if (errno != 0)
+    {
+        perror("readdir failed");
+        table_free(t);
+        closedir(dp);
+        return -1;
+    }
+    closedir(dp);
+    return 0;
+}
+
+/*
+ * Filesystems where a directory's link count does not track its
+ * subdirectories: btrfs always reports 1, and network/FUSE/overlay
+ * filesystems pass through whatever the backend says.
+ */
+#define BTRFS_MAGIC    0x9123683E
+#define NFS_MAGIC      0x6969
+#define CIFS_MAGIC     0xFF534D42
+#define SMB2_MAGIC     0xFE534D42
+#define FUSE_MAGIC     0x65735546
+#define OVERLAY_MAGIC  0x794C7630
+
+/* 1 if st_nlink of directories on fd's filesystem can be trusted (cached per device) */
+static int nlink_counts_subdirs(int fd, dev_t dev)
+{
+    static __thread dev_t last_dev;
+    static __thread int last_result = -1;
+    if (last_result >= 0 && dev == last_dev) return last_result;
+
+    struct statfs sfs;
+    int result = 0;
+    if (fstatfs(fd, &sfs) == 0)
+    {
+        switch ((unsigned long)sfs.f_type)
+        {
+            case BTRFS_MAGIC: case NFS_MAGIC: case CIFS_MAGIC:
+            case SMB2_MAGIC: case FUSE_MAGIC: case OVERLAY_MAGIC:
+                result = 0;
+                break;
+            default:
+                result = 1;
+        }
+    }
+    last_dev = dev;
+    last_result = result;
+    return result;
+}
+
+static void table_free(struct entry_table *t)
+{
+    free(t->pool);
+    free(t->name_off);
+    free(t->name_len);
+    free(t->width);
+    free(t->name_flags);
+    free(t->d_type);
+    free(t->ino);
+    free(t->mode);
+    free(t->has_stat);
+    free(t->st);
+    free(t->sum);
+    free(t->sum_state);
+    memset(t, 0, sizeof(*t));
+}
+
+/* ---------- width / escaping stage ---------- */
+
+/*
+ * A name is "plain" when every byte is in 0x20..0x7e. The scanners return
+ * nonzero for plain names. The SIMD versions rely on a signed compare:
+ * bytes >= 0x80 are negative, so one "< 0x20" test catches both control
+ * characters and the start of any multibyte sequence; 0x7f (DEL) is
+ * checked separately.
+ */
+
+static int scan_plain_scalar(const unsigned char *s, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+        if (s[i] < 0x20 || s[i] >= 0x7f) return 0;
+    return 1;
+}
+
+#ifdef HAVE_X86_SIMD
+static int scan_plain_sse2(const unsigned char *s, size_t len)
+{
+    const __m128i lo = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, lo), _mm_cmpeq_epi8(v, del));
+        if (_mm_movemask_epi8(bad)) return 0;
+    }
+    return scan_plain_scalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int scan_plain_avx2(const unsigned char *s, size_t len)
+{
+    const __m256i lo = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        /* AVX2 has no signed less-than: v < 0x20 is 0x20 > v */
+        __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(lo, v), _mm256_cmpeq_epi8(v, del));
+        if (_mm256_movemask_epi8(bad)) return 0;
+    }
+    return scan_plain_sse2(s + i, len - i);
+}
+#endif
+
+static int (*scan_plain)(const unsigned char *s, size_t len) = scan_plain_scalar;
+
+/* pick the widest scanner this CPU supports (call before starting threads) */
+static void init_name_scan(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) scan_plain = scan_plain_avx2;
+    else scan_plain = scan_plain_sse2;
+#endif
+}
+
+/* columns a non-plain name occupies; escaped characters count as one */
+static size_t decode_width(const char *s, size_t len)
+{
+    mbstate_t ps;
+    memset(&ps, 0, sizeof(ps));
+    size_t w = 0, i = 0;
+    while (i < len)
+    {
+        wchar_t wc;
+        size_t n = mbrtowc(&wc, s + i, len - i, &ps);
+        if (n == (size_t)-1 || n == (size_t)-2)
+        {
+            /* invalid or truncated sequence: one '?' per byte */
+            memset(&ps, 0, sizeof(ps));
+            w++;
+            i++;
+            continue;
+        }
+        if (n == 0) break;
+        int cw = wcwidth(wc);
+        w += cw < 0 ? 1 : (size_t)cw;
+        i += n;
+    }
+    return w;
+}
+
+/* fill width[] and name_flags[] for every entry, and maxwidth */
+static void measure_entries(struct entry_table *t)
+{
+    size_t maxw = 0;
+    for (size_t i = 0; i < t->count; ++i)
+    {
+        const char *name = ENT_NAME(t, i);
+        size_t len = t->name_len[i];
+        size_t w;
+        if (scan_plain((const unsigned char *)name, len))
+        {
+            t->name_flags[i] = NAME_PLAIN;
+            w = len;
+        }
+        else
+        {
+            t->name_flags[i] = 0;
+            w = decode_width(name, len);
+        }
+        t->width[i] = (uint16_t)w;
+        if (w > maxw) maxw = w;
+    }
+    t->maxwidth = maxw;
+}
+
+/* write a name, replacing unprintable characters with '?' */
+static void print_escaped(const char *s)
+{
+    size_t len = strlen(s);
+    mbstate_t ps;
+    memset(&ps, 0, sizeof(ps));
+    size_t i = 0;
+    while (i < len)
+    {
+        wchar_t wc;
+        size_t n = mbrtowc(&wc, s + i, len - i, &ps);
+        if (n == (size_t)-1 || n == (size_t)-2)
+        {
+            memset(&ps, 0, sizeof(ps));
+            fputc('?', out_fp);
+            i++;
+            continue;
+        }
+        if (n == 0) break;
+        if (wcwidth(wc) < 0) fputc('?', out_fp);
+        else fwrite(s + i, 1, n, out_fp);
+        i += n;
+    }
+}
+
+/* detect archive-like filenames by extension */
+static int is_archive_name(const char *name)
+{
+    const char *exts[] = { ".tar", ".tar.gz", ".tgz", ".gz", ".zip", ".bz2", ".xz", NULL };
+    for (int i = 0; exts[i]; ++i)
+    {
+        size_t l = strlen(name);
+        size_t e = strlen(exts[i]);
+        if (l >= e)
+        {
+            if (strcasecmp(name + l - e, exts[i]) == 0) return 1;
+        }
+    }
+    return 0;
+}
+
+/* the type class a name is colored by (and counted under by --summary) */
+static name_class_t classify_name(const char *name, mode_t mode)
+{
+    if (S_ISLNK(mode)) return CLS_LINK;
+    if (S_ISDIR(mode)) return CLS_DIR;
+    if (S_ISCHR(mode) || S_ISBLK(mode) || S_ISSOCK(mode) || S_ISFIFO(mode)) return CLS_SPECIAL;
+    if (is_archive_name(name)) return CLS_ARCHIVE;
+    if ((mode & S_IXUSR) || (mode & S_IXGRP) || (mode & S_IXOTH)) return CLS_EXEC;
+    return CLS_PLAIN;
+}
+
+/* print name in the color for its type and pad spaces (pad is number of characters to add after printed name) */
+static void print_name_colored(const char *name, mode_t mode, int pad, int plain)
+{
+    const char *start = color_enabled ? class_color[classify_name(name, mode)] : "";
+
+    if (start[0] != '\0') fprintf(out_fp, "%s", start);
+    if (escape_names && !plain) print_escaped(name);
+    else fputs(name, out_fp);
+    if (start[0] != '\0') fputs(CLR_RESET, out_fp);
+
+    for (int i = 0; i < pad; ++i) fputc(' ', out_fp);
+}
+
+/*
+ * print table entry i colored and padded. The type bits come from the
+ * cached mode, else from d_type when that is enough to pick the color
+ * (everything but plain regular files), else from one stat that is
+ * then cached in the table.
+ */
+static void print_entry_with_pad(const char *dir, struct entry_table *t, size_t i, int pad)
+{
+    const char *name = ENT_NAME(t, i);
+    unsigned char dt = t->d_type[i];
+    mode_t mode;
+
+    if (!color_enabled) mode = 0; /* type not needed: no stat */
+    else if (t->has_stat[i]) mode = t->mode[i];
+    else if (dt != DT_UNKNOWN && dt != DT_REG) mode = DTTOIF(dt);
+    else if (dt == DT_REG && is_archive_name(name)) mode = S_IFREG;
+    else
+    {
+        char path[PATH_MAX];
+        struct stat st;
+        /* on error just print plain */
+        if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path) ||
+            stat_at(-1, NULL, path, &st) == -1)
+        {
+            if (escape_names && !(t->name_flags[i] & NAME_PLAIN)) print_escaped(name);
+            else fputs(name, out_fp);
+            for (int k = 0; k < pad; ++k) fputc(' ', out_fp);
+            return;
+        }
+        mode = st.st_mode;
+        t->mode[i] = mode;
+        t->has_stat[i] = 1;
+    }
+    print_name_colored(name, mode, pad, t->name_flags[i] & NAME_PLAIN);
+}
+
+/* ---------- displays ---------- */
+
+/* default: down then across */
+static void display_down_across(struct entry_table *t, int term_width, const char *dir)
+{
+    const int spacing = 2;
+    size_t count = t->count;
+    int col_width = (int)t->maxwidth + spacing;
+    if (col_width <= 0) col_width = 1;
+    int num_cols = term_width / col_width;
+    if (num_cols < 1) num_cols = 1;
+    if ((size_t)num_cols > count) num_cols = (int)count;
+    int num_rows = (count + num_cols - 1) / num_cols;
+
+    for (int r = 0; r < num_rows; ++r)
+    {
+        for (int c = 0; c < num_cols; ++c)
+        {
+            int idx = c * num_rows + r;
+            if (idx >= (int)count) continue;
+            int is_last_col = (c == num_cols - 1);
+            int pad = is_last_col ? 0 : (col_width - (int)t->width[idx]);
+            print_entry_with_pad(dir, t, idx, pad);
+        }
+        fputc('\n', out_fp);
+    }
+}
+
+/* horizontal (-x): row-major */
+static void display_horizontal(struct entry_table *t, int term_width, const char *dir)
+{
+    const int spacing = 2;
+    int col_width = (int)t->maxwidth + spacing;
+    if (col_width <= 0) col_width = 1;
+
+    int curr = 0;
+    for (size_t i = 0; i < t->count; ++i)
+    {
+        int name_len = (int)t->width[i];
+        int field = col_width;
+        if (name_len >= term_width)
+        {
+            if (curr != 0) { fputc('\n', out_fp); curr = 0; }
+            print_entry_with_pad(dir, t, i, 0);
+            fputc('\n', out_fp);
+            continue;
+        }
+        if (curr + field > term_width)
+        {
+            fputc('\n', out_fp);
+            curr = 0;
+        }
+        int pad = field - name_len;
+        print_entry_with_pad(dir, t, i, pad);
+        curr += field;
+    }
+    if (curr != 0) fputc('\n', out_fp);
+}
+
+/* long listing (-l) */
+static void display_long(const char *dir, struct entry_table *t)
+{
+    for (size_t i = 0; i < t->count; ++i)
+    {
+        const char *name = ENT_NAME(t, i);
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path))
+        {
+            /* fallback: print name only */
+            fprintf(out_fp, "%s\n", name);
+            continue;
+        }
+        char sum[17];
+        if (!checksum_flag) sum[0] = '\0';
+        else if (t->sum_state && t->sum_state[i] == SUM_OK)
+            snprintf(sum, sizeof(sum), "%016llx", (unsigned long long)t->sum[i]);
+        else snprintf(sum, sizeof(sum), "%-16s", t->sum_state && t->sum_state[i] == SUM_FAILED ? "?" : "-");
+        print_long_format(path, name, (t->st && t->has_stat[i]) ? &t->st[i] : NULL,
+                          t->name_flags[i] & NAME_PLAIN, checksum_flag ? sum : NULL);
+    }
+}
+
+/* print long format but color the file name */
+static void print_long_format(const char *path, const char *filename, const struct stat *cached, int plain,
+                              const char *sum)
+{
+    struct stat st;
+    if (cached) st = *cached;
+    else if (stat_at(-1, NULL, path, &st) == -1) { perror("lstat"); return; }
+
+    print_permissions(st.st_mode);
+    fprintf(out_fp, " %3ld", (long)st.st_nlink);
+
+    /* reentrant lookups: operand workers format listings concurrently */
+    char pwbuf[1024], grbuf[1024];
+    struct passwd pwd, *pw = NULL;
+    struct group grp, *gr = NULL;
+    getpwuid_r(st.st_uid, &pwd, pwbuf, sizeof(pwbuf), &pw);
+    getgrgid_r(st.st_gid, &grp, grbuf, sizeof(grbuf), &gr);
+    fprintf(out_fp, " %-8s %-8s", pw ? pw->pw_name : "unknown", gr ? gr->gr_name : "unknown");
+
+    fprintf(out_fp, " %8ld", (long)st.st_size);
+    if (sum) fprintf(out_fp, " %s", sum);
+
+    char timebuf[64];
+    struct tm tmv;
+    strftime(timebuf, sizeof(timebuf), "%b %d %H:%M", localtime_r(&st.st_mtime, &tmv));
+    fprintf(out_fp, " %s ", timebuf);
+
+    /* the mode is already at hand, so color without another lstat */
+    print_name_colored(filename, st.st_mode, 0, plain);
+
+    fputc('\n', out_fp);
+}
+
+/* permissions string */
+static void print_permissions(mode_t mode)
+{
+    char perms[11];
+    perms[0] = S_ISDIR(mode) ? 'd' :
+               S_ISLNK(mode) ? 'l' :
+               S_ISCHR(mode) ? 'c' :
+               S_ISBLK(mode) ? 'b' :
+               S_ISSOCK(mode) ? 's' :
+               S_ISFIFO(mode) ? 'p' : '-';
+    perms[1] = (mode & S_IRUSR) ? 'r' : '-';
+    perms[2] = (mode & S_IWUSR) ? 'w' : '-';
+    perms[3] = (mode & S_IXUSR) ? 'x' : '-';
+    perms[4] = (mode & S_IRGRP) ? 'r' : '-';
+    perms[5] = (mode & S_IWGRP) ? 'w' : '-';
+    perms[6] = (mode & S_IXGRP) ? 'x' : '-';
+    perms[7] = (mode & S_IROTH) ? 'r' : '-';
+    perms[8] = (mode & S_IWOTH) ? 'w' : '-';
+    perms[9] = (mode & S_IXOTH) ? 'x' : '-';
+    perms[10] = '\0';
+    fprintf(out_fp, "%s", perms);
+}
+
+/* ---------- sort stage ---------- */
+
+/*
+ * Stable merge sort over fixed-size records. Below PAR_SORT_MIN it runs
+ * on the caller; above it the array is cut into one chunk per core, the
+ * chunks are sorted by worker threads and then merged pairwise, each
+ * round's merges again running in parallel. The comparator never touches
+ * the filesystem: keys are precomputed before the sort starts.
+ */
+
+typedef int (*cmp_fn)(const void *, const void *);
+
+static void merge_runs(char *dst, const char *a, size_t na, const char *b, size_t nb,
+                       size_t size, cmp_fn cmp)
+{
+    while (na > 0 && nb > 0)
+    {
+        if (cmp(a, b) <= 0) { memcpy(dst, a, size); a += size; na--; }
+        else { memcpy(dst, b, size); b += size; nb--; }
+        dst += size;
+    }
+    if (na > 0) memcpy(dst, a, na * size);
+    if (nb > 0) memcpy(dst, b, nb * size);
+}
+
+/* sort base[0..n) using tmp (same size) as scratch; result ends in base */
+static void merge_sort_seq(char *base, char *tmp, size_t n, size_t size, cmp_fn cmp)
+{
+    if (n <= 16)
+    {
+        /* insertion sort, stable */
+        for (size_t i = 1; i < n; ++i)
+        {
+            memcpy(tmp, base + i * size, size);
+            size_t j = i;
+            while (j > 0 && cmp(base + (j - 1) * size, tmp) > 0)
+            {
+                memcpy(base + j * size, base + (j - 1) * size, size);
+                j--;
+            }
+            memcpy(base + j * size, tmp, size);
+        }
+        return;
+    }
+    size_t half = n / 2;
+    merge_sort_seq(base, tmp, half, size, cmp);
+    merge_sort_seq(base + half * size, tmp + half * size, n - half, size, cmp);
+    if (cmp(base + (half - 1) * size, base + half * size) <= 0) return; /* already ordered */
+    merge_runs(tmp, base, half, base + half * size, n - half, size, cmp);
+    memcpy(base, tmp, n * size);
+}
+
+struct sort_job
+{
+    pthread_t tid;
+    char *src, *dst;            /* merge: src runs -> dst; sort: in place in src */
+    size_t lo, mid, hi;         /* record indexes */
+    size_t size;
+    cmp_fn cmp;
+};
+
+static void *sort_chunk_thread(void *arg)
+{
+    struct sort_job *j = arg;
+    merge_sort_seq(j->src + j->lo * j->size, j->dst + j->lo * j->size, j->hi - j->lo, j->size, j->cmp);
+    return NULL;
+}
+
+static void *merge_chunk_thread(void *arg)
+{
+    struct sort_job *j = arg;
+    merge_runs(j->dst + j->lo * j->size,
+               j->src + j->lo * j->size, j->mid - j->lo,
+               j->src + j->mid * j->size, j->hi - j->mid, j->size, j->cmp);
+    return NULL;
+}
+
+/* run jobs[0..n) on threads; fall back to the caller if a thread cannot start */
+static void run_sort_jobs(struct sort_job *jobs, int n, void *(*fn)(void *))
+{
+    int started[64];
+    for (int i = 0; i < n; ++i)
+        started[i] = pthread_create(&jobs[i].tid, NULL, fn, &jobs[i]) == 0;
+    for (int i = 0; i < n; ++i)
+    {
+        if (started[i]) pthread_join(jobs[i].tid, NULL);
+        else fn(&jobs[i]);
+    }
+}
+
+static void parallel_merge_sort(void *base, size_t n, size_t size, cmp_fn cmp)
+{
+    if (n < 2) return;
+    char *tmp = malloc(n * size);
+    if (!tmp)
+    {
+        qsort(base, n, size, cmp); /* no scratch space: unstable but still ordered */
+        return;
+    }
+
+    int nthreads = default_thread_count();
+    if (n < PAR_SORT_MIN || nthreads < 2)
+    {
+        merge_sort_seq(base, tmp, n, size, cmp);
+        free(tmp);
+        return;
+    }
+
+    size_t bounds[65];
+    struct sort_job jobs[64];
+    for (int i = 0; i <= nthreads; ++i) bounds[i] = n * (size_t)i / (size_t)nthreads;
+    for (int i = 0; i < nthreads; ++i)
+    {
+        jobs[i].src = base;
+        jobs[i].dst = tmp;
+        jobs[i].lo = bounds[i];
+        jobs[i].hi = bounds[i + 1];
+        jobs[i].size = size;
+        jobs[i].cmp = cmp;
+    }
+    run_sort_jobs(jobs, nthreads, sort_chunk_thread);
+
+    /* pairwise merge rounds, ping-ponging between base and tmp */
+    char *src = base, *dst = tmp;
+    for (int width = 1; width < nthreads; width *= 2)
+    {
+        int nj = 0;
+        for (int i = 0; i < nthreads; i += 2 * width)
+        {
+            int m = i + width < nthreads ? i + width : nthreads;
+            int h = i + 2 * width < nthreads ? i + 2 * width : nthreads;
+            jobs[nj].src = src;
+            jobs[nj].dst = dst;
+            jobs[nj].lo = bounds[i];
+            jobs[nj].mid = bounds[m];
+            jobs[nj].hi = bounds[h];
+            jobs[nj].size = size;
+            jobs[nj].cmp = cmp;
+            nj++;
+        }
+        run_sort_jobs(jobs, nj, merge_chunk_thread);
+        char *t = src; src = dst; dst = t;
+    }
+    if (src != base) memcpy(base, src, n * size);
+    free(tmp);
+}
+
+/* inode order record for the metadata stage */
+struct ino_rec
+{
+    uint64_t ino;
+    uint32_t idx;
+};
+
+static int cmp_ino_rec(const void *a, const void *b)
+{
+    const struct ino_rec *x = a, *y = b;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    return x->idx < y->idx ? -1 : (x->idx > y->idx);
+}
+
+/*
+ * fill the full stat cache (see stat_at); entries that fail keep
+ * has_stat == 0. Entries are visited in inode number order, which on
+ * ext4/xfs reads the inode table front to back; results land in each
+ * entry's own slot, so the later name sort is unaffected.
+ */
+static void stat_entries(const char *dir, struct entry_table *t)
+{
+    t->st = calloc(t->count, sizeof(struct stat));
+    if (!t->st) return;
+
+    struct ino_rec *by_ino = t->count <= UINT32_MAX ? malloc(t->count * sizeof(*by_ino)) : NULL;
+    if (by_ino)
+    {
+        for (size_t i = 0; i < t->count; ++i) { by_ino[i].ino = t->ino[i]; by_ino[i].idx = (uint32_t)i; }
+        parallel_merge_sort(by_ino, t->count, sizeof(*by_ino), cmp_ino_rec);
+    }
+
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+    for (size_t k = 0; k < t->count; ++k)
+    {
+        size_t i = by_ino ? by_ino[k].idx : k;
+        const char *name = ENT_NAME(t, i);
+        int rc;
+        if (dfd >= 0) rc = stat_at(dfd, name, NULL, &t->st[i]);
+        else
+        {
+            char path[PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) rc = -1;
+            else rc = stat_at(-1, NULL, path, &t->st[i]);
+        }
+        /* unreadable entries sort as oldest / empty */
+        if (rc == -1) memset(&t->st[i], 0, sizeof(struct stat));
+        else
+        {
+            t->mode[i] = t->st[i].st_mode;
+            t->has_stat[i] = 1;
+        }
+    }
+    if (dfd >= 0) close(dfd);
+    free(by_ino);
+}
+
+/* name sort record: the name pointer first so cmpstring_ci applies as is */
+struct name_rec
+{
+    char *name;
+    uint32_t idx;
+};
+
+/* packed key sort record: precomputed key plus the entry's name rank */
+struct key_rec
+{
+    int64_t key;
+    uint32_t idx;
+};
+
+/* larger key first; equal keys keep name order */
+static int cmp_key_rec(const void *a, const void *b)
+{
+    const struct key_rec *x = a, *y = b;
+    if (x->key != y->key) return x->key > y->key ? -1 : 1;
+    return x->idx < y->idx ? -1 : (x->idx > y->idx);
+}
+
+static int64_t sort_key_of(const struct stat *st)
+{
+    if (sort_key == SORT_TIME)
+        return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    return (int64_t)st->st_size;
+}
+
+/* reorder one column: col[i] = old col[order[i]] */
+static void permute_column(void *col, size_t elsize, const uint32_t *order, size_t count, char *scratch)
+{
+    char *c = col;
+    for (size_t i = 0; i < count; ++i)
+        memcpy(scratch + i * elsize, c + (size_t)order[i] * elsize, elsize);
+    memcpy(c, scratch, count * elsize);
+}
+
+/*
+ * sort_entries:
+ *  - orders the table by name, then by the -t / -S key with name order
+ *    breaking ties, then applies -r
+ *  - sorts a permutation and applies it to every column; the name pool
+ *    itself never moves
+ */
+static void sort_entries(struct entry_table *t)
+{
+    size_t count = t->count;
+    if (count < 2) return;
+
+    struct name_rec *nrec = malloc(count * sizeof(*nrec));
+    uint32_t *order = malloc(count * sizeof(*order));
+    if (!nrec || !order)
+    {
+        free(nrec);
+        free(order);
+        return; /* out of memory: leave directory order */
+    }
+
+    for (size_t i = 0; i < count; ++i) { nrec[i].name = ENT_NAME(t, i); nrec[i].idx = (uint32_t)i; }
+    parallel_merge_sort(nrec, count, sizeof(*nrec), cmpstring_ci);
+    for (size_t i = 0; i < count; ++i) order[i] = nrec[i].idx;
+    free(nrec);
+
+    if (sort_key != SORT_NAME && t->st)
+    {
+        struct key_rec *krec = malloc(count * sizeof(*krec));
+        if (krec)
+        {
+            /* idx is the name rank, so equal keys stay in name order */
+            for (size_t i = 0; i < count; ++i)
+            {
+                krec[i].key = sort_key_of(&t->st[order[i]]);
+                krec[i].idx = (uint32_t)i;
+            }
+            parallel_merge_sort(krec, count, sizeof(*krec), cmp_key_rec);
+            uint32_t *by_key = malloc(count * sizeof(*by_key));
+            if (by_key)
+            {
+                for (size_t i = 0; i < count; ++i) by_key[i] = order[krec[i].idx];
+                free(order);
+                order = by_key;
+            }
+            free(krec);
+        }
+    }
+
+    if (reverse_flag)
+    {
+        for (size_t i = 0, j = count - 1; i < j; ++i, --j)
+        {
+            uint32_t tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+        }
+    }
+
+    /* apply the permutation to every column */
+    /* scratch must fit the widest column: the stat cache, else ino_t */
+    char *scratch = malloc(count * (t->st ? sizeof(struct stat) : sizeof(ino_t)));
+    if (scratch)
+    {
+        permute_column(t->name_off, sizeof(*t->name_off), order, count, scratch);
+        permute_column(t->name_len, sizeof(*t->name_len), order, count, scratch);
+        permute_column(t->width, sizeof(*t->width), order, count, scratch);
+        permute_column(t->name_flags, 1, order, count, scratch);
+        permute_column(t->d_type, 1, order, count, scratch);
+        permute_column(t->ino, sizeof(*t->ino), order, count, scratch);
+        permute_column(t->mode, sizeof(*t->mode), order, count, scratch);
+        permute_column(t->has_stat, 1, order, count, scratch);
+        if (t->st) permute_column(t->st, sizeof(struct stat), order, count, scratch);
+        free(scratch);
+    }
+    free(order);
+}
+
+/* ---------- stat helpers ---------- */
+
+/*
+ * stat one entry, by dfd + name when dfd >= 0, else by path. Without -L
+ * this is lstat(); with -L it follows the link and falls back to the link
+ * itself when the target is missing (dangling links are still listed).
+ */
+static int stat_at(int dfd, const char *name, const char *path, struct stat *st)
+{
+    if (dfd >= 0)
+    {
+        if (follow_links && fstatat(dfd, name, st, 0) == 0) return 0;
+        return fstatat(dfd, name, st, AT_SYMLINK_NOFOLLOW);
+    }
+    if (follow_links && stat(path, st) == 0) return 0;
+    return lstat(path, st);
+}
+
+/* ---------- visited directory set (-L) ---------- */
+
+static size_t visited_hash(dev_t dev, ino_t ino)
+{
+    uint64_t h = (uint64_t)ino ^ ((uint64_t)dev * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+static struct visited_set *visited_new(void)
+{
+    struct visited_set *v = calloc(1, sizeof(*v));
+    if (!v) return NULL;
+    v->cap = 1024;
+    v->dev = calloc(v->cap, sizeof(dev_t));
+    v->ino = calloc(v->cap, sizeof(ino_t));
+    if (!v->dev || !v->ino)
+    {
+        visited_free(v);
+        return NULL;
+    }
+    return v;
+}
+
+static void visited_free(struct visited_set *v)
+{
+    if (!v) return;
+    free(v->dev);
+    free(v->ino);
+    free(v);
+}
+
+/* place a key known to be absent; cap has room */
+static void visited_place(dev_t *devs, ino_t *inos, size_t cap, dev_t dev, ino_t ino)
+{
+    size_t i = visited_hash(dev, ino) & (cap - 1);
+    while (devs[i] != 0 || inos[i] != 0) i = (i + 1) & (cap - 1);
+    devs[i] = dev;
+    inos[i] = ino;
+}
+
+/* returns 1 if newly inserted, 0 if already present, -1 on allocation failure */
+static int visited_insert(struct visited_set *v, dev_t dev, ino_t ino)
+{
+    if (dev == 0 && ino == 0) ino = (ino_t)-1; /* keep the empty marker free */
+
+    size_t mask = v->cap - 1;
+    for (size_t i = visited_hash(dev, ino) & mask; v->dev[i] != 0 || v->ino[i] != 0; i = (i + 1) & mask)
+        if (v->dev[i] == dev && v->ino[i] == ino) return 0;
+
+    if ((v->count + 1) * 2 > v->cap)
+    {
+        size_t cap = v->cap * 2;
+        dev_t *devs = calloc(cap, sizeof(dev_t));
+        ino_t *inos = calloc(cap, sizeof(ino_t));
+        if (!devs || !inos) { free(devs); free(inos); return -1; }
+        for (size_t i = 0; i < v->cap; ++i)
+            if (v->dev[i] != 0 || v->ino[i] != 0)
+                visited_place(devs, inos, cap, v->dev[i], v->ino[i]);
+        free(v->dev);
+        free(v->ino);
+        v->dev = devs;
+        v->ino = inos;
+        v->cap = cap;
+    }
+    visited_place(v->dev, v->ino, v->cap, dev, ino);
+    v->count++;
+    return 1;
+}
+
+/* ---------- filesystem pruning ---------- */
+
+/* split a comma-separated type list into skip_fs_types */
+static int parse_skip_fs_types(const char *list)
+{
+    size_t n = 0;
+    if (skip_fs_types) while (skip_fs_types[n]) n++;
+
+    char *copy = strdup(list);
+    if (!copy) return -1;
+    char *save = NULL;
+    for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+        char **tmp = realloc(skip_fs_types, (n + 2) * sizeof(char *));
+        if (!tmp) { free(copy); return -1; }
+        skip_fs_types = tmp;
+        skip_fs_types[n] = strdup(tok);
+        if (!skip_fs_types[n]) { free(copy); return -1; }
+        skip_fs_types[++n] = NULL;
+    }
+    free(copy);
+    return n > 0 ? 0 : -1;
+}
+
+/*
+ * mountinfo lines look like
+ *   36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 /dev/root rw
+ * field 3 is the device, and the type follows the " - " separator.
+ * Only mounts of a skipped type are kept.
+ */
+static int load_mountinfo(void)
+{
+    FILE *fp = fopen("/proc/self/mountinfo", "r");
+    if (!fp) return -1;
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, fp) != -1)
+    {
+        unsigned int maj, min;
+        if (sscanf(line, "%*u %*u %u:%u", &maj, &min) != 2) continue;
+        char *sep = strstr(line, " - ");
+        if (!sep) continue;
+        char fstype[64];
+        if (sscanf(sep + 3, "%63s", fstype) != 1) continue;
+
+        int skipped = 0;
+        for (size_t i = 0; skip_fs_types[i]; ++i)
+            if (strcmp(skip_fs_types[i], fstype) == 0) { skipped = 1; break; }
+        if (!skipped) continue;
+
+        struct mount_entry *tmp = realloc(mounts, (mount_count + 1) * sizeof(*mounts));
+        if (!tmp) break;
+        mounts = tmp;
+        mounts[mount_count].dev = makedev(maj, min);
+        mounts[mount_count].fstype = strdup(fstype);
+        if (mounts[mount_count].fstype) mount_count++;
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * prune_dir:
+ *  - returns 1 if the directory described by st must not be opened:
+ *    it is on another device than top_dev with --one-file-system, or on
+ *    a filesystem whose type is listed in --skip-fs-type
+ */
+static int prune_dir(const struct stat *st, dev_t top_dev)
+{
+    if (one_file_system && st->st_dev != top_dev) return 1;
+    if (mount_count == 0) return 0;
+
+    /* consecutive directories are nearly always on the same device */
+    static __thread dev_t last_dev;
+    static __thread int last_result = -1;
+    if (last_result >= 0 && st->st_dev == last_dev) return last_result;
+
+    int result = 0;
+    for (size_t i = 0; i < mount_count; ++i)
+        if (mounts[i].dev == st->st_dev) { result = 1; break; }
+    last_dev = st->st_dev;
+    last_result = result;
+    return result;
+}
+
+/* ---------- exclude patterns ---------- */
+
+/* parse one gitignore line into r; returns 0 if the line holds no pattern */
+static int compile_rule(const char *line, struct ignore_rule *r)
+{
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                       line[len - 1] == ' ' || line[len - 1] == '\t'))
+        len--;
+    if (len == 0 || line[0] == '#') return 0;
+
+    unsigned flags = 0;
+    if (line[0] == '!') { flags |= IGN_NEGATE; line++; len--; }
+    if (len > 0 && line[len - 1] == '/') { flags |= IGN_DIR_ONLY; len--; }
+    if (len >= 3 && strncmp(line, "**/", 3) == 0) { line += 3; len -= 3; }
+    else if (len > 0 && line[0] == '/') { flags |= IGN_ANCHORED; line++; len--; }
+    if (len == 0) return 0;
+    if (memchr(line, '/', len)) flags |= IGN_ANCHORED;
+
+    char *pat = strndup(line, len);
+    if (!pat) return 0;
+    if (!strpbrk(pat, "*?[\\")) flags |= IGN_LITERAL;
+    else if (pat[0] == '*' && !strpbrk(pat + 1, "*?[\\/")) flags |= IGN_SUFFIX;
+
+    r->pat = pat;
+    r->len = len;
+    r->flags = flags;
+    return 1;
+}
+
+/* append the rules of one pattern file; fp is closed */
+static int read_rules(FILE *fp, struct ignore_rule **rules, size_t *count)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, fp) != -1)
+    {
+        struct ignore_rule r;
+        if (!compile_rule(line, &r)) continue;
+        struct ignore_rule *tmp = realloc(*rules, (*count + 1) * sizeof(**rules));
+        if (!tmp) { free(r.pat); break; }
+        *rules = tmp;
+        (*rules)[(*count)++] = r;
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+static int load_exclude_file(const char *file)
+{
+    FILE *fp = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+    if (!fp) return -1;
+    return read_rules(fp, &exclude_rules, &exclude_count);
+}
+
+/* new node holding one reference to parent; NULL on allocation failure */
+static struct ignore_node *ignore_node_new(const char *dir, struct ignore_rule *rules, size_t nrules,
+                                           int owns, struct ignore_node *parent)
+{
+    struct ignore_node *node = calloc(1, sizeof(*node));
+    if (!node) return NULL;
+    node->base = strdup(dir);
+    node->base_len = node->base ? strlen(node->base) : 0;
+    node->rules = rules;
+    node->nrules = nrules;
+    node->owns_rules = owns;
+    node->refs = 1;
+    node->parent = parent;
+    if (parent) __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+/*
+ * ignore_enter:
+ *  - returns the rule node for dir. At an operand root (parent == NULL)
+ *    the --exclude-from rules start a chain; with --gitignore, a
+ *    .gitignore in dir adds a node on top. Otherwise it is parent itself.
+ *  - the caller owns one reference to the result (NULL: nothing excluded)
+ */
+static struct ignore_node *ignore_enter(const char *dir, struct ignore_node *parent)
+{
+    struct ignore_node *base = parent;
+    if (base) __atomic_add_fetch(&base->refs, 1, __ATOMIC_RELAXED);
+    else if (exclude_count > 0)
+        base = ignore_node_new(dir, exclude_rules, exclude_count, 0, NULL);
+
+    if (!use_gitignore) return base;
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/.gitignore", dir) >= (int)sizeof(path)) return base;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return base;
+
+    struct ignore_rule *rules = NULL;
+    size_t nrules = 0;
+    read_rules(fp, &rules, &nrules);
+    if (nrules == 0) { free(rules); return base; }
+
+    struct ignore_node *node = ignore_node_new(dir, rules, nrules, 1, base);
+    if (!node)
+    {
+        for (size_t i = 0; i < nrules; ++i) free(rules[i].pat);
+        free(rules);
+        return base;
+    }
+    ignore_unref(base); /* node holds its own reference */
+    return node;
+}
+
+static void ignore_unref(struct ignore_node *node)
+{
+    while (node && __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        struct ignore_node *parent = node->parent;
+        if (node->owns_rules)
+        {
+            for (size_t i = 0; i < node->nrules; ++i) free(node->rules[i].pat);
+            free(node->rules);
+        }
+        free(node->base);
+        free(node);
+        node = parent;
+    }
+}
+
+static int rule_matches(const struct ignore_rule *r, const char *name, const char *rel)
+{
+    if (r->flags & IGN_ANCHORED) return fnmatch(r->pat, rel, FNM_PATHNAME) == 0;
+    if (r->flags & IGN_LITERAL) return strcmp(r->pat, name) == 0;
+    if (r->flags & IGN_SUFFIX)
+    {
+        size_t nl = strlen(name), sl = r->len - 1;
+        return nl >= sl && memcmp(name + nl - sl, r->pat + 1, sl) == 0;
+    }
+    return fnmatch(r->pat, name, 0) == 0;
+}
+
+/* 1 if name (inside dir) is excluded by the chain starting at node */
+static int ignore_match(const struct ignore_node *node, const char *dir, const char *name, int is_dir)
+{
+    for (; node; node = node->parent)
+    {
+        /* path of the entry relative to the node's directory */
+        char rel[PATH_MAX];
+        const char *sub = "";
+        if (node->base && strncmp(dir, node->base, node->base_len) == 0)
+        {
+            sub = dir + node->base_len;
+            while (*sub == '/') sub++;
+        }
+        if (snprintf(rel, sizeof(rel), "%s%s%s", sub, *sub ? "/" : "", name) >= (int)sizeof(rel))
+            continue;
+
+        for (size_t i = node->nrules; i-- > 0; )
+        {
+            const struct ignore_rule *r = &node->rules[i];
+            if ((r->flags & IGN_DIR_ONLY) && !is_dir) continue;
+            if (rule_matches(r, name, rel)) return !(r->flags & IGN_NEGATE);
+        }
+    }
+    return 0;
+}
+
+/* ---------- content checksums (-l --checksum) ---------- */
+
+/*
+ * XXH64, bundled so there is no library dependency. Streaming form: the
+ * input arrives in read() buffers or mmap windows of any size.
+ */
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+struct xxh64_state
+{
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char mem[32];
+    size_t memsize;
+};
+
+static inline uint64_t xxh_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    return xxh_rotl(acc, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t h, uint64_t v)
+{
+    h ^= xxh_round(0, v);
+    return h * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_init(struct xxh64_state *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->v[0] = XXH_P1 + XXH_P2;
+    s->v[1] = XXH_P2;
+    s->v[2] = 0;
+    s->v[3] = -XXH_P1;
+}
+
+static void xxh64_update(struct xxh64_state *s, const unsigned char *p, size_t len)
+{
+    s->total += len;
+    if (s->memsize + len < 32)
+    {
+        memcpy(s->mem + s->memsize, p, len);
+        s->memsize += len;
+        return;
+    }
+    if (s->memsize > 0)
+    {
+        size_t fill = 32 - s->memsize;
+        memcpy(s->mem + s->memsize, p, fill);
+        for (int k = 0; k < 4; ++k) s->v[k] = xxh_round(s->v[k], xxh_read64(s->mem + 8 * k));
+        p += fill;
+        len -= fill;
+        s->memsize = 0;
+    }
+    uint64_t v0 = s->v[0], v1 = s->v[1], v2 = s->v[2], v3 = s->v[3];
+    for (; len >= 32; p += 32, len -= 32)
+    {
+        v0 = xxh_round(v0, xxh_read64(p));
+        v1 = xxh_round(v1, xxh_read64(p + 8));
+        v2 = xxh_round(v2, xxh_read64(p + 16));
+        v3 = xxh_round(v3, xxh_read64(p + 24));
+    }
+    s->v[0] = v0; s->v[1] = v1; s->v[2] = v2; s->v[3] = v3;
+    memcpy(s->mem, p, len);
+    s->memsize = len;
+}
+
+static uint64_t xxh64_digest(const struct xxh64_state *s)
+{
+    uint64_t h;
+    if (s->total >= 32)
+    {
+        h = xxh_rotl(s->v[0], 1) + xxh_rotl(s->v[1], 7) + xxh_rotl(s->v[2], 12) + xxh_rotl(s->v[3], 18);
+        for (int k = 0; k < 4; ++k) h = xxh_merge(h, s->v[k]);
+    }
+    else h = XXH_P5;
+    h += s->total;
+
+    const unsigned char *p = s->mem;
+    size_t len = s->memsize;
+    for (; len >= 8; p += 8, len -= 8)
+        h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (len >= 4)
+    {
+        uint32_t w;
+        memcpy(&w, p, sizeof(w));
+        h = xxh_rotl(h ^ (uint64_t)w * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; ++p, --len)
+        h = xxh_rotl(h ^ *p * XXH_P5, 11) * XXH_P1;
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ * Files below HASH_MMAP_MIN are read() through a stack buffer; larger
+ * ones are mapped HASH_WINDOW bytes at a time. Every file holds
+ * min(size, HASH_WINDOW) bytes of the global in-flight budget while it is
+ * hashed, so all hashing threads together (operand workers included)
+ * never touch more than HASH_INFLIGHT_MAX bytes at once.
+ */
+#define HASH_MMAP_MIN     (256 * 1024)
+#define HASH_READ_BUF     (64 * 1024)
+#define HASH_WINDOW       (16 * 1024 * 1024)
+#define HASH_INFLIGHT_MAX (64 * 1024 * 1024)
+#define HASH_INLINE_BYTES (1024 * 1024)   /* smaller directories are hashed without a pool */
+
+static pthread_mutex_t hash_budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hash_budget_cond = PTHREAD_COND_INITIALIZER;
+static size_t hash_inflight = 0;
+
+static void hash_budget_acquire(size_t n)
+{
+    pthread_mutex_lock(&hash_budget_lock);
+    /* a lone file may exceed the limit, or it would never run */
+    while (hash_inflight > 0 && hash_inflight + n > HASH_INFLIGHT_MAX)
+        pthread_cond_wait(&hash_budget_cond, &hash_budget_lock);
+    hash_inflight += n;
+    pthread_mutex_unlock(&hash_budget_lock);
+}
+
+static void hash_budget_release(size_t n)
+{
+    pthread_mutex_lock(&hash_budget_lock);
+    hash_inflight -= n;
+    pthread_cond_broadcast(&hash_budget_cond);
+    pthread_mutex_unlock(&hash_budget_lock);
+}
+
+/* hash the regular file name in dfd; 0 on success. st must describe it. */
+static int hash_file(int dfd, const char *name, const struct stat *st, uint64_t *out)
+{
+    int fd = openat(dfd, name, O_RDONLY | O_NOCTTY | (follow_links ? 0 : O_NOFOLLOW));
+    if (fd == -1) return -1;
+    struct stat fst;
+    /* replaced since it was stat()ed: the cached size/mtime would lie */
+    if (fstat(fd, &fst) == -1 || fst.st_dev != st->st_dev || fst.st_ino != st->st_ino)
+    {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t)fst.st_size;
+    size_t reserve = size < HASH_WINDOW ? size : HASH_WINDOW;
+    hash_budget_acquire(reserve);
+
+    struct xxh64_state s;
+    xxh64_init(&s);
+    int rc = 0;
+    if (size >= HASH_MMAP_MIN)
+    {
+        for (size_t off = 0; off < size && rc == 0; off += HASH_WINDOW)
+        {
+            size_t len = size - off < HASH_WINDOW ? size - off : HASH_WINDOW;
+            void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, (off_t)off);
+            if (map == MAP_FAILED) { rc = -1; break; }
+            madvise(map, len, MADV_SEQUENTIAL | MADV_WILLNEED);
+            xxh64_update(&s, map, len);
+            munmap(map, len);
+        }
+    }
+    else
+    {
+        unsigned char rbuf[HASH_READ_BUF];
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ssize_t n;
+        while ((n = read(fd, rbuf, sizeof(rbuf))) != 0)
+        {
+            if (n == -1)
+            {
+                if (errno == EINTR) continue;
+                rc = -1;
+                break;
+            }
+            xxh64_update(&s, rbuf, (size_t)n);
+        }
+    }
+
+    hash_budget_release(reserve);
+    close(fd);
+    if (rc == 0) *out = xxh64_digest(&s);
+    return rc;
+}
+
+/*
+ * Persistent cache of hashes keyed by (dev, ino), valid while size and
+ * mtime still match. Loaded on first use from $XDG_CACHE_HOME/ls-checksums
+ * (or ~/.cache/ls-checksums) and written back at exit when it changed.
+ */
+#define HASH_CACHE_MAGIC 0x314B43534CULL
+
+struct hash_cache_rec
+{
+    uint64_t dev, ino;
+    int64_t size, mtime_ns;
+    uint64_t hash;
+};
+
+static pthread_mutex_t hash_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_cache_rec *hash_cache;    /* open addressing, ino == 0 is empty */
+static size_t hash_cache_count, hash_cache_cap;
+static int hash_cache_loaded, hash_cache_dirty;
+
+static char *hash_cache_path(void)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char *path = NULL;
+    if (xdg && xdg[0]) { if (asprintf(&path, "%s/ls-checksums", xdg) == -1) path = NULL; }
+    else if (home && home[0]) { if (asprintf(&path, "%s/.cache/ls-checksums", home) == -1) path = NULL; }
+    return path;
+}
+
+static size_t hash_cache_slot(const struct hash_cache_rec *v, size_t cap, uint64_t dev, uint64_t ino)
+{
+    size_t j = (size_t)((ino ^ (dev << 32 | dev >> 32)) * 0x9E3779B97F4A7C15ULL) & (cap - 1);
+    while (v[j].ino != 0 && (v[j].dev != dev || v[j].ino != ino)) j = (j + 1) & (cap - 1);
+    return j;
+}
+
+/* add or replace a record; call with hash_cache_lock held */
+static void hash_cache_put(const struct hash_cache_rec *r)
+{
+    if (r->ino == 0) return;
+    if ((hash_cache_count + 1) * 2 > hash_cache_cap)
+    {
+        size_t cap = hash_cache_cap ? hash_cache_cap * 2 : 1024;
+        struct hash_cache_rec *v = calloc(cap, sizeof(*v));
+        if (!v) return;
+        for (size_t i = 0; i < hash_cache_cap; ++i)
+            if (hash_cache[i].ino != 0)
+                v[hash_cache_slot(v, cap, hash_cache[i].dev, hash_cache[i].ino)] = hash_cache[i];
+        free(hash_cache);
+        hash_cache = v;
+        hash_cache_cap = cap;
+    }
+    size_t j = hash_cache_slot(hash_cache, hash_cache_cap, r->dev, r->ino);
+    if (hash_cache[j].ino == 0) hash_cache_count++;
+    hash_cache[j] = *r;
+}
+
+/* call with hash_cache_lock held */
+static void hash_cache_load(void)
+{
+    hash_cache_loaded = 1;
+    char *path = hash_cache_path();
+    FILE *fp = path ? fopen(path, "rb") : NULL;
+    free(path);
+    if (!fp) return;
+    uint64_t magic;
+    struct hash_cache_rec r;
+    if (fread(&magic, sizeof(magic), 1, fp) == 1 && magic == HASH_CACHE_MAGIC)
+        while (fread(&r, sizeof(r), 1, fp) == 1) hash_cache_put(&r);
+    fclose(fp);
+}
+
+/* write the cache back (temp file + rename) if this run added to it */
+static void hash_cache_save(void)
+{
+    if (!hash_cache_dirty) return;
+    char *path = hash_cache_path();
+    char *tmp = NULL;
+    if (!path || asprintf(&tmp, "%s.%ld", path, (long)getpid()) == -1)
+    {
+        free(path);
+        return;
+    }
+    char *slash = strrchr(path, '/');
+    if (slash)
+    {
+        *slash = '\0';
+        mkdir(path, 0700);
+        *slash = '/';
+    }
+    FILE *fp = fopen(tmp, "wb");
+    if (fp)
+    {
+        uint64_t magic = HASH_CACHE_MAGIC;
+        int ok = fwrite(&magic, sizeof(magic), 1, fp) == 1;
+        for (size_t i = 0; ok && i < hash_cache_cap; ++i)
+            if (hash_cache[i].ino != 0) ok = fwrite(&hash_cache[i], sizeof(hash_cache[i]), 1, fp) == 1;
+        if (fclose(fp) != 0) ok = 0;
+        if (!ok || rename(tmp, path) == -1) unlink(tmp);
+    }
+    free(tmp);
+    free(path);
+    free(hash_cache);
+    hash_cache = NULL;
+    hash_cache_count = hash_cache_cap = 0;
+    hash_cache_dirty = 0;
+}
+
+static int64_t stat_mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+/* work list of one directory, shared by its hashing threads */
+struct hash_job
+{
+    struct entry_table *t;
+    int dfd;
+    uint32_t *idx;               /* entries to hash */
+    size_t n;
+    size_t next;                 /* atomically claimed */
+};
+
+static void *hash_worker(void *arg)
+{
+    struct hash_job *job = arg;
+    size_t k;
+    while ((k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n && !scan_stopped())
+    {
+        uint32_t i = job->idx[k];
+        const struct stat *st = &job->t->st[i];
+        if (hash_file(job->dfd, ENT_NAME(job->t, i), st, &job->t->sum[i]) != 0) continue;
+        job->t->sum_state[i] = SUM_OK;
+
+        struct hash_cache_rec r = { st->st_dev, st->st_ino, st->st_size, stat_mtime_ns(st), job->t->sum[i] };
+        pthread_mutex_lock(&hash_cache_lock);
+        hash_cache_put(&r);
+        hash_cache_dirty = 1;
+        pthread_mutex_unlock(&hash_cache_lock);
+    }
+    return NULL;
+}
+
+/*
+ * fill t->sum for every regular file of a stat()ed table: cache hits
+ * first, then the misses on a pool of threads (or inline when they are
+ * few and small)
+ */
+static void checksum_entries(const char *dir, struct entry_table *t)
+{
+    if (!t->st) return;
+    t->sum = malloc(t->count * sizeof(*t->sum));
+    t->sum_state = calloc(t->count, 1);
+    uint32_t *idx = malloc(t->count * sizeof(*idx));
+    if (!t->sum || !t->sum_state || !idx)
+    {
+        free(idx);
+        return;
+    }
+
+    struct hash_job job = { t, -1, idx, 0, 0 };
+    size_t bytes = 0;
+    pthread_mutex_lock(&hash_cache_lock);
+    if (!hash_cache_loaded) hash_cache_load();
+    for (size_t i = 0; i < t->count; ++i)
+    {
+        const struct stat *st = &t->st[i];
+        if (!t->has_stat[i] || !S_ISREG(st->st_mode)) continue;
+        t->sum_state[i] = SUM_FAILED;
+        if (hash_cache_cap > 0)
+        {
+            const struct hash_cache_rec *r =
+                &hash_cache[hash_cache_slot(hash_cache, hash_cache_cap, st->st_dev, st->st_ino)];
+            if (r->ino != 0 && r->size == st->st_size && r->mtime_ns == stat_mtime_ns(st))
+            {
+                t->sum[i] = r->hash;
+                t->sum_state[i] = SUM_OK;
+                continue;
+            }
+        }
+        idx[job.n++] = (uint32_t)i;
+        bytes += (size_t)st->st_size;
+    }
+    pthread_mutex_unlock(&hash_cache_lock);
+
+    if (job.n > 0 && (job.dfd = open(dir, O_RDONLY | O_DIRECTORY)) != -1)
+    {
+        int nthreads = default_thread_count();
+        if ((size_t)nthreads > job.n) nthreads = (int)job.n;
+        if (bytes < HASH_INLINE_BYTES) nthreads = 1;
+
+        pthread_t tids[64];
+        int started = 0;
+        for (int i = 1; i < nthreads; ++i)
+        {
+            if (pthread_create(&tids[started], NULL, hash_worker, &job) != 0) break;
+            started++;
+        }
+        hash_worker(&job);
+        for (int i = 0; i < started; ++i) pthread_join(tids[i], NULL);
+        close(job.dfd);
+    }
+    free(idx);
+}
+
+/* ---------- recursive processor ---------- */
+
+/*
+ * process_dir_recursive:
+ *  - prints directory header
+ *  - reads and sorts entries
+ *  - displays entries according to mode
+ *  - if recursive == 1, descends into subdirectories (excluding . and ..;
+ *    symlinks only with -L, and then each real directory only once)
+ */
+void process_dir_recursive(const char *dir, display_mode_t mode, int recursive)
+{
+    /* the outermost call sets up the per-operand traversal state */
+    int own_visited = 0;
+    if (recursion_depth == 0 && recursive)
+    {
+        struct stat rst;
+        int have_root = stat(dir, &rst) == 0;
+        root_dev = have_root ? rst.st_dev : 0;
+
+        /* -L: this operand's listing owns the visited set */
+        if (follow_links && (visited = visited_new()) != NULL)
+        {
+            own_visited = 1;
+            if (have_root) visited_insert(visited, rst.st_dev, rst.st_ino);
+        }
+    }
+
+    /* exclude rules for this directory (operand root: --exclude-from) */
+    struct ignore_node *parent_ign = ignore_cur;
+    if (recursion_depth == 0) parent_ign = NULL;
+    struct ignore_node *ign = (exclude_count > 0 || use_gitignore) ? ignore_enter(dir, parent_ign) : NULL;
+
+    /* Print directory header like `ls -R` */
+    fprintf(out_fp, "%s:\n", dir);
+
+    /* Read entries */
+    struct entry_table t;
+    if (read_dir_entries(dir, &t, ign) == -1)
+    {
+        fprintf(stderr, "Cannot open or read directory: %s\n", dir);
+        ignore_unref(ign);
+        if (own_visited) { visited_free(visited); visited = NULL; }
+        return;
+    }
+
+    /* stat every entry once when the listing or the sort key needs it */
+    if (t.count > 0 && (mode == MODE_LONG || sort_key != SORT_NAME))
+        stat_entries(dir, &t);
+
+    if (t.count > 0)
+    {
+        /* display widths and escaping flags */
+        measure_entries(&t);
+
+        /* sort entries (all columns move together) */
+        sort_entries(&t);
+
+        /* hashes are looked up/computed in final order, so they need no permuting */
+        if (checksum_flag && mode == MODE_LONG) checksum_entries(dir, &t);
+
+        /* display according to mode */
+        int term_width = get_terminal_width();
+        if (mode == MODE_LONG) display_long(dir, &t);
+        else if (mode == MODE_HORIZONTAL) display_horizontal(&t, term_width, dir);
+        else display_down_across(&t, term_width, dir);
+        check_output();
+    }
+
+    /* If recursive, for every entry that is a directory (and not . or ..), recurse */
+    if (recursive)
+    {
+        /*
+         * Subdirectories still to find, when the link count says so. Hidden
+         * or excluded subdirectories are never seen, which only keeps this
+         * from reaching zero. Links to directories are not counted, so -L
+         * cannot use it.
+         */
+        long subdirs_left = (t.nlink_reliable && !follow_links) ? (long)t.dir_nlink - 2 : -1;
+
+        for (size_t i = 0; i < t.count && subdirs_left != 0 && !scan_stopped(); ++i)
+        {
+            const char *name = ENT_NAME(&t, i);
+
+            /* skip . and .. just in case (should already be skipped) */
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+            /* known non-directories (cached mode or d_type) need no stat */
+            if (t.has_stat[i] && !S_ISDIR(t.mode[i])) continue;
+            if (!t.has_stat[i] && t.d_type[i] != DT_UNKNOWN && t.d_type[i] != DT_DIR) continue;
+
+            /* build full path */
+            char path[PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path))
+                continue; /* path too long, skip */
+
+            if (!t.has_stat[i] && t.d_type[i] == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (stat_at(-1, NULL, path, &st) == -1)
+                    continue;
+                t.mode[i] = st.st_mode;
+                t.has_stat[i] = 1;
+            }
+
+            /* If it is a directory (a symlink only with -L), recurse */
+            if (t.has_stat[i] ? S_ISDIR(t.mode[i]) : t.d_type[i] == DT_DIR)
+            {
+                if (subdirs_left > 0) subdirs_left--;
+
+                /* device / inode checks happen before the directory is opened */
+                if (visited || one_file_system || mount_count > 0)
+                {
+                    struct stat st;
+                    if (t.st && t.has_stat[i]) st = t.st[i];
+                    else if (stat(path, &st) == -1) continue;
+                    if (prune_dir(&st, root_dev)) continue;
+                    if (visited && visited_insert(visited, st.st_dev, st.st_ino) == 0)
+                    {
+                        fprintf(stderr, "%s: not listing already-listed directory\n", path);
+                        continue;
+                    }
+                }
+                fputc('\n', out_fp);
+                recursion_depth++;
+                ignore_cur = ign;
+                process_dir_recursive(path, mode, recursive);
+                ignore_cur = parent_ign;
+                recursion_depth--;
+            }
+        }
+    }
+
+    table_free(&t);
+    ignore_unref(ign);
+    if (own_visited) { visited_free(visited); visited = NULL; }
+}
+
+/* ---------- parallel tree walker ---------- */
+
+/*
+ * A small work-stack walker shared by the whole-tree modes (--top, ...).
+ * Directories are pushed on a shared LIFO stack; each worker pops one,
+ * reads it, lstat()s every entry relative to the open directory and hands
+ * it to the visit callback together with that worker's private context.
+ * Subdirectories (not symlinks) are pushed back for any worker to take.
+ * Hidden entries are skipped, same as the listing code.
+ */
+
+typedef void (*walk_visit_fn)(void *ctx, const char *path, const char *name, const struct stat *st);
+
+struct walk_item
+{
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    dev_t root_dev;              /* device of the operand it came from */
+    struct ignore_node *ign;     /* exclude rules of the parent directory */
+    struct walk_item *next;
+};
+
+struct walker
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct walk_item *stack;
+    size_t pending;              /* queued + in-progress directories */
+    walk_visit_fn visit;
+    struct visited_set *seen;    /* -L: directories already queued */
+};
+
+struct walk_worker
+{
+    pthread_t tid;
+    struct walker *w;
+    void *ctx;
+};
+
+static int default_thread_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > 64) n = 64;
+    return (int)n;
+}
+
+static void walk_item_free(struct walk_item *it)
+{
+    ignore_unref(it->ign);
+    free(it->path);
+    free(it);
+}
+
+/*
+ * push a batch of directories with one lock round-trip; with -L, items
+ * whose (dev, ino) was already queued once are dropped here
+ */
+static void walker_push(struct walker *w, struct walk_item *head, struct walk_item *tail, size_t n)
+{
+    if (n == 0) return;
+    pthread_mutex_lock(&w->lock);
+    if (w->seen)
+    {
+        struct walk_item *keep = NULL, *keep_tail = NULL, *next;
+        n = 0;
+        for (struct walk_item *it = head; it; it = next)
+        {
+            next = it->next;
+            if (visited_insert(w->seen, it->dev, it->ino) == 0)
+            {
+                walk_item_free(it);
+                continue;
+            }
+            it->next = keep;
+            keep = it;
+            if (!keep_tail) keep_tail = it;
+            n++;
+        }
+        head = keep;
+        tail = keep_tail;
+        if (n == 0) { pthread_mutex_unlock(&w->lock); return; }
+    }
+    tail->next = w->stack;
+    w->stack = head;
+    w->pending += n;
+    if (n == 1) pthread_cond_signal(&w->cond);
+    else pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void walker_scan_dir(struct walker *w, void *ctx, const struct walk_item *self)
+{
+    const char *dir = self->path;
+    dev_t top_dev = self->root_dev;
+    DIR *dp = opendir(dir);
+    if (!dp)
+    {
+        fprintf(stderr, "Cannot open or read directory: %s\n", dir);
+        return;
+    }
+    /* roots have no parent rules: that is where --exclude-from applies */
+    struct ignore_node *ign = NULL;
+    if (exclude_count > 0 || use_gitignore)
+        ign = ignore_enter(dir, self->ign ? self->ign : NULL);
+    int dfd = dirfd(dp);
+    struct walk_item *head = NULL, *tail = NULL;
+    size_t nsub = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL && !scan_stopped())
+    {
+        if (entry->d_name[0] == '.') continue;
+
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path))
+            continue; /* path too long, skip */
+
+        struct stat st;
+        if (stat_at(dfd, entry->d_name, NULL, &st) == -1)
+            continue;
+
+        if (ign && ignore_match(ign, dir, entry->d_name, S_ISDIR(st.st_mode)))
+            continue;
+        if (!take_entry()) break;
+
+        w->visit(ctx, path, entry->d_name, &st);
+
+        if (S_ISDIR(st.st_mode) && !prune_dir(&st, top_dev))
+        {
+            struct walk_item *it = malloc(sizeof(*it));
+            if (!it) continue;
+            it->path = strdup(path);
+            if (!it->path) { free(it); continue; }
+            it->dev = st.st_dev;
+            it->ino = st.st_ino;
+            it->root_dev = top_dev;
+            it->ign = ign;
+            if (ign) __atomic_add_fetch(&ign->refs, 1, __ATOMIC_RELAXED);
+            it->next = head;
+            head = it;
+            if (!tail) tail = it;
+            nsub++;
+        }
+    }
+    closedir(dp);
+    ignore_unref(ign);
+    walker_push(w, head, tail, nsub);
+}
+
+static void *walker_thread(void *arg)
+{
+    struct walk_worker *ww = arg;
+    struct walker *w = ww->w;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&w->lock);
+        while (!w->stack && w->pending > 0)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->stack)
+        {
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        struct walk_item *it = w->stack;
+        w->stack = it->next;
+        pthread_mutex_unlock(&w->lock);
+
+        walker_scan_dir(w, ww->ctx, it);
+        walk_item_free(it);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->pending == 0) pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+/*
+ * walk_tree_parallel:
+ *  - walks every root with nthreads workers
+ *  - ctxs[i] is the private context handed to worker i's visit calls
+ *  - returns 0 on success, -1 if no worker could be started
+ */
+static int walk_tree_parallel(char **roots, size_t nroots, int nthreads,
+                              walk_visit_fn visit, void **ctxs)
+{
+    struct walker w;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.stack = NULL;
+    w.pending = 0;
+    w.visit = visit;
+    w.seen = follow_links ? visited_new() : NULL;
+
+    /* push roots in reverse so the first operand is popped first */
+    for (size_t i = nroots; i-- > 0; )
+    {
+        struct walk_item *it = malloc(sizeof(*it));
+        if (!it) continue;
+        it->path = strdup(roots[i]);
+        if (!it->path) { free(it); continue; }
+        struct stat rst;
+        if (stat(roots[i], &rst) == 0) { it->dev = rst.st_dev; it->ino = rst.st_ino; }
+        else { it->dev = 0; it->ino = 0; }
+        it->root_dev = it->dev;
+        it->ign = NULL;
+        it->next = NULL;
+        walker_push(&w, it, it, 1);
+    }
+
+    struct walk_worker *workers = calloc((size_t)nthreads, sizeof(*workers));
+    if (!workers) return -1;
+    int started = 0;
+    for (int i = 0; i < nthreads; ++i)
+    {
+        workers[i].w = &w;
+        workers[i].ctx = ctxs[i];
+        if (pthread_create(&workers[i].tid, NULL, walker_thread, &workers[i]) != 0) break;
+        started++;
+    }
+    /* no threads at all: walk on the calling thread */
+    if (started == 0)
+    {
+        workers[0].w = &w;
+        workers[0].ctx = ctxs[0];
+        walker_thread(&workers[0]);
+    }
+    for (int i = 0; i < started; ++i) pthread_join(workers[i].tid, NULL);
+
+    free(workers);
+    visited_free(w.seen);
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+    return 0;
+}
+
+/* ---------- top-K mode ---------- */
+
+/*
+ * Each worker keeps a min-heap of its K best entries, the root being the
+ * "worst" of them. A new entry only costs a compare against the root
+ * unless it displaces it. Ties on the key are broken by path so the
+ * result does not depend on thread scheduling.
+ */
+
+struct top_entry
+{
+    long long key;      /* size in bytes or mtime in nanoseconds */
+    long long size;
+    time_t mtime;
+    char *path;
+};
+
+struct top_heap
+{
+    struct top_entry *v;
+    size_t count, k;
+    int by_mtime;
+};
+
+/* >0 if a ranks above b (bigger key, then smaller path) */
+static int top_rank_cmp(const struct top_entry *a, long long bkey, const char *bpath)
+{
+    if (a->key != bkey) return a->key > bkey ? 1 : -1;
+    return strcmp(bpath, a->path);
+}
+
+static void top_sift_down(struct top_heap *h, size_t i)
+{
+    for (;;)
+    {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < h->count && top_rank_cmp(&h->v[l], h->v[m].key, h->v[m].path) < 0) m = l;
+        if (r < h->count && top_rank_cmp(&h->v[r], h->v[m].key, h->v[m].path) < 0) m = r;
+        if (m == i) return;
+        struct top_entry t = h->v[i]; h->v[i] = h->v[m]; h->v[m] = t;
+        i = m;
+    }
+}
+
+static void top_sift_up(struct top_heap *h, size_t i)
+{
+    while (i > 0)
+    {
+        size_t p = (i - 1) / 2;
+        if (top_rank_cmp(&h->v[i], h->v[p].key, h->v[p].path) >= 0) return;
+        struct top_entry t = h->v[i]; h->v[i] = h->v[p]; h->v[p] = t;
+        i = p;
+    }
+}
+
+static void top_offer(struct top_heap *h, long long key, long long size, time_t mtime, const char *path)
+{
+    if (h->count == h->k)
+    {
+        /* not better than the current worst: drop without copying the path */
+        if (top_rank_cmp(&h->v[0], key, path) >= 0) return;
+        char *dup = strdup(path);
+        if (!dup) return;
+        free(h->v[0].path);
+        h->v[0].key = key;
+        h->v[0].size = size;
+        h->v[0].mtime = mtime;
+        h->v[0].path = dup;
+        top_sift_down(h, 0);
+        return;
+    }
+    char *dup = strdup(path);
+    if (!dup) return;
+    h->v[h->count].key = key;
+    h->v[h->count].size = size;
+    h->v[h->count].mtime = mtime;
+    h->v[h->count].path = dup;
+    top_sift_up(h, h->count);
+    h->count++;
+}
+
+static void top_visit(void *ctx, const char *path, const char *name, const struct stat *st)
+{
+    struct top_heap *h = ctx;
+    (void)name;
+    if (!S_ISREG(st->st_mode)) return;
+    long long key = h->by_mtime
+        ? (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec
+        : (long long)st->st_size;
+    top_offer(h, key, (long long)st->st_size, st->st_mtime, path);
+}
+
+static int run_top_k(char **dirs, size_t ndirs, size_t k, int by_mtime)
+{
+    int nthreads = default_thread_count();
+    struct top_heap *heaps = calloc((size_t)nthreads, sizeof(*heaps));
+    void **ctxs = calloc((size_t)nthreads, sizeof(*ctxs));
+    if (!heaps || !ctxs)
+    {
+        perror("calloc");
+        free(heaps);
+        free(ctxs);
+        return 1;
+    }
+    for (int i = 0; i < nthreads; ++i)
+    {
+        heaps[i].k = k;
+        heaps[i].by_mtime = by_mtime;
+        heaps[i].v = malloc(k * sizeof(struct top_entry));
+        if (!heaps[i].v) { perror("malloc"); return 1; }
+        ctxs[i] = &heaps[i];
+    }
+
+    walk_tree_parallel(dirs, ndirs, nthreads, top_visit, ctxs);
+
+    /* merge every worker heap into the first one */
+    struct top_heap *res = &heaps[0];
+    for (int i = 1; i < nthreads; ++i)
+    {
+        for (size_t j = 0; j < heaps[i].count; ++j)
+        {
+            struct top_entry *e = &heaps[i].v[j];
+            top_offer(res, e->key, e->size, e->mtime, e->path);
+            free(e->path);
+        }
+        free(heaps[i].v);
+    }
+
+    /* pop worst-first, then print best-first */
+    size_t n = res->count;
+    struct top_entry *out = malloc((n ? n : 1) * sizeof(*out));
+    if (!out) { perror("malloc"); return 1; }
+    for (size_t i = n; i-- > 0; )
+    {
+        out[i] = res->v[0];
+        res->v[0] = res->v[--res->count];
+        top_sift_down(res, 0);
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        char timebuf[64];
+        struct tm tmv;
+        strftime(timebuf, sizeof(timebuf), "%b %d %H:%M", localtime_r(&out[i].mtime, &tmv));
+        fprintf(out_fp, "%12lld %s %s\n", out[i].size, timebuf, out[i].path);
+        free(out[i].path);
+    }
+
+    free(out);
+    free(res->v);
+    free(heaps);
+    free(ctxs);
+    return 0;
+}
+
+/* ---------- summary mode ---------- */
+
+/*
+ * --summary: each walker thread counts into its own summary_acc, so the
+ * visit callback takes no locks. Owners, groups and extensions go into
+ * small open-addressing maps; the accumulators are folded into the first
+ * one after the walk and only then sorted and printed.
+ */
+
+#define SUM_HIST_BUCKETS 65      /* 0, then [2^(b-1), 2^b) for b = 1..64 */
+#define SUM_TOP_EXT      10
+#define SUM_EXT_MAX      16      /* longer "extensions" are not counted */
+
+struct sum_bucket
+{
+    uint64_t key;                /* uid/gid, or hash of ext */
+    char *ext;                   /* extension maps only */
+    unsigned long long files, bytes;
+    int used;
+};
+
+struct sum_map
+{
+    struct sum_bucket *v;
+    size_t count, cap;           /* cap is a power of two */
+};
+
+struct summary_acc
+{
+    unsigned long long class_files[CLS_COUNT], class_bytes[CLS_COUNT];
+    unsigned long long hist_files[SUM_HIST_BUCKETS], hist_bytes[SUM_HIST_BUCKETS];
+    struct sum_map owners, groups, exts;
+};
+
+static uint64_t sum_hash_str(const char *s, size_t len)
+{
+    uint64_t h = 1469598103934665603ULL;       /* FNV-1a */
+    for (size_t i = 0; i < len; ++i) h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    return h;
+}
+
+/* find or add the bucket for key (and ext, if given); NULL when out of memory */
+static struct sum_bucket *sum_map_get(struct sum_map *m, uint64_t key, const char *ext, size_t len)
+{
+    if ((m->count + 1) * 2 > m->cap)
+    {
+        size_t cap = m->cap ? m->cap * 2 : 64;
+        struct sum_bucket *v = calloc(cap, sizeof(*v));
+        if (!v) return NULL;
+        for (size_t i = 0; i < m->cap; ++i)
+        {
+            if (!m->v[i].used) continue;
+            size_t j = (size_t)(m->v[i].key * 0x9E3779B97F4A7C15ULL) & (cap - 1);
+            while (v[j].used) j = (j + 1) & (cap - 1);
+            v[j] = m->v[i];
+        }
+        free(m->v);
+        m->v = v;
+        m->cap = cap;
+    }
+    size_t j = (size_t)(key * 0x9E3779B97F4A7C15ULL) & (m->cap - 1);
+    while (m->v[j].used)
+    {
+        struct sum_bucket *b = &m->v[j];
+        if (b->key == key && (!ext || (strlen(b->ext) == len && memcmp(b->ext, ext, len) == 0)))
+            return b;
+        j = (j + 1) & (m->cap - 1);
+    }
+    struct sum_bucket *b = &m->v[j];
+    if (ext && !(b->ext = strndup(ext, len))) return NULL;
+    b->key = key;
+    b->used = 1;
+    m->count++;
+    return b;
+}
+
+static void sum_map_free(struct sum_map *m)
+{
+    for (size_t i = 0; i < m->cap; ++i) free(m->v[i].ext);
+    free(m->v);
+}
+
+static void sum_map_add(struct sum_map *m, uint64_t key, const char *ext, size_t len,
+                        unsigned long long files, unsigned long long bytes)
+{
+    struct sum_bucket *b = sum_map_get(m, key, ext, len);
+    if (!b) return;
+    b->files += files;
+    b->bytes += bytes;
+}
+
+/* histogram bucket of a size: 0 for empty files, else 1 + floor(log2(size)) */
+static int sum_size_bucket(unsigned long long size)
+{
+    return size == 0 ? 0 : 64 - __builtin_clzll(size);
+}
+
+static void summary_visit(void *ctx, const char *path, const char *name, const struct stat *st)
+{
+    struct summary_acc *a = ctx;
+    (void)path;
+    unsigned long long bytes = (unsigned long long)st->st_size;
+    name_class_t cls = classify_name(name, st->st_mode);
+    a->class_files[cls]++;
+    a->class_bytes[cls] += bytes;
+    sum_map_add(&a->owners, st->st_uid, NULL, 0, 1, bytes);
+    sum_map_add(&a->groups, st->st_gid, NULL, 0, 1, bytes);
+    if (!S_ISREG(st->st_mode)) return;
+
+    int b = sum_size_bucket(bytes);
+    a->hist_files[b]++;
+    a->hist_bytes[b] += bytes;
+    /* extension: after the last '.', not counting a leading one */
+    const char *dot = strrchr(name, '.');
+    if (dot && dot != name && dot[1] != '\0')
+    {
+        size_t len = strlen(dot + 1);
+        if (len <= SUM_EXT_MAX) sum_map_add(&a->exts, sum_hash_str(dot + 1, len), dot + 1, len, 1, bytes);
+    }
+}
+
+static void summary_merge_map(struct sum_map *dst, struct sum_map *src)
+{
+    for (size_t i = 0; i < src->cap; ++i)
+    {
+        struct sum_bucket *b = &src->v[i];
+        if (!b->used) continue;
+        sum_map_add(dst, b->key, b->ext, b->ext ? strlen(b->ext) : 0, b->files, b->bytes);
+    }
+}
+
+/* largest first; ids or names break ties so the report is stable */
+static int cmp_bucket_bytes(const void *a, const void *b)
+{
+    const struct sum_bucket *x = *(const struct sum_bucket *const *)a;
+    const struct sum_bucket *y = *(const struct sum_bucket *const *)b;
+    if (x->bytes != y->bytes) return x->bytes > y->bytes ? -1 : 1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static int cmp_bucket_files(const void *a, const void *b)
+{
+    const struct sum_bucket *x = *(const struct sum_bucket *const *)a;
+    const struct sum_bucket *y = *(const struct sum_bucket *const *)b;
+    if (x->files != y->files) return x->files > y->files ? -1 : 1;
+    return strcmp(x->ext, y->ext);
+}
+
+/* the used buckets of m as a sorted array of pointers; sets *n */
+static struct sum_bucket **sum_map_sorted(struct sum_map *m, int (*cmp)(const void *, const void *), size_t *n)
+{
+    struct sum_bucket **v = malloc((m->count ? m->count : 1) * sizeof(*v));
+    *n = 0;
+    if (!v) return NULL;
+    for (size_t i = 0; i < m->cap; ++i)
+        if (m->v[i].used) v[(*n)++] = &m->v[i];
+    parallel_merge_sort(v, *n, sizeof(*v), cmp);
+    return v;
+}
+
+/* 1536 -> "1.5K"; plain bytes below 1024 */
+static void format_size(unsigned long long n, char *buf, size_t len)
+{
+    static const char units[] = "KMGTPE";
+    if (n < 1024)
+    {
+        snprintf(buf, len, "%llu", n);
+        return;
+    }
+    double v = (double)n;
+    int u = -1;
+    while (v >= 1024 && u < 5) { v /= 1024; u++; }
+    snprintf(buf, len, v < 10 && v != (int)v ? "%.1f%c" : "%.0f%c", v, units[u]);
+}
+
+static void summary_print_ids(struct sum_map *m, int groups)
+{
+    size_t n;
+    struct sum_bucket **v = sum_map_sorted(m, cmp_bucket_bytes, &n);
+    if (!v) return;
+    fprintf(out_fp, "\nBy %s:\n", groups ? "group" : "owner");
+    for (size_t i = 0; i < n; ++i)
+    {
+        char buf[1024], idbuf[32], sz[16];
+        const char *label = NULL;
+        if (groups)
+        {
+            struct group grp, *gr = NULL;
+            getgrgid_r((gid_t)v[i]->key, &grp, buf, sizeof(buf), &gr);
+            if (gr) label = gr->gr_name;
+        }
+        else
+        {
+            struct passwd pwd, *pw = NULL;
+            getpwuid_r((uid_t)v[i]->key, &pwd, buf, sizeof(buf), &pw);
+            if (pw) label = pw->pw_name;
+        }
+        if (!label)
+        {
+            snprintf(idbuf, sizeof(idbuf), "%llu", (unsigned long long)v[i]->key);
+            label = idbuf;
+        }
+        format_size(v[i]->bytes, sz, sizeof(sz));
+        fprintf(out_fp, "  %-16s %10llu %8s\n", label, v[i]->files, sz);
+    }
+    free(v);
+}
+
+static void summary_print(struct summary_acc *a)
+{
+    char sz[16], lo[16], hi[16];
+    unsigned long long files = 0, bytes = 0;
+
+    fprintf(out_fp, "By type:\n");
+    for (int c = 0; c < CLS_COUNT; ++c)
+    {
+        files += a->class_files[c];
+        bytes += a->class_bytes[c];
+        if (a->class_files[c] == 0) continue;
+        format_size(a->class_bytes[c], sz, sizeof(sz));
+        fprintf(out_fp, "  %-16s %10llu %8s\n", class_label[c], a->class_files[c], sz);
+    }
+    format_size(bytes, sz, sizeof(sz));
+    fprintf(out_fp, "  %-16s %10llu %8s\n", "total", files, sz);
+
+    summary_print_ids(&a->owners, 0);
+    summary_print_ids(&a->groups, 1);
+
+    fprintf(out_fp, "\nRegular file sizes:\n");
+    for (int b = 0; b < SUM_HIST_BUCKETS; ++b)
+    {
+        if (a->hist_files[b] == 0) continue;
+        format_size(a->hist_bytes[b], sz, sizeof(sz));
+        if (b == 0)
+        {
+            fprintf(out_fp, "  %-16s %10llu %8s\n", "0", a->hist_files[b], sz);
+            continue;
+        }
+        format_size(1ULL << (b - 1), lo, sizeof(lo));
+        if (b < 64) format_size(1ULL << b, hi, sizeof(hi));
+        else snprintf(hi, sizeof(hi), "16E");
+        char range[40];
+        snprintf(range, sizeof(range), "[%s, %s)", lo, hi);
+        fprintf(out_fp, "  %-16s %10llu %8s\n", range, a->hist_files[b], sz);
+    }
+
+    size_t n;
+    struct sum_bucket **v = sum_map_sorted(&a->exts, cmp_bucket_files, &n);
+    if (!v) return;
+    fprintf(out_fp, "\nTop extensions:\n");
+    for (size_t i = 0; i < n && i < SUM_TOP_EXT; ++i)
+    {
+        char label[SUM_EXT_MAX + 2];
+        snprintf(label, sizeof(label), ".%s", v[i]->ext);
+        format_size(v[i]->bytes, sz, sizeof(sz));
+        fprintf(out_fp, "  %-16s %10llu %8s\n", label, v[i]->files, sz);
+    }
+    free(v);
+}
+
+static int run_summary(char **dirs, size_t ndirs)
+{
+    int nthreads = default_thread_count();
+    struct summary_acc *accs = calloc((size_t)nthreads, sizeof(*accs));
+    void **ctxs = calloc((size_t)nthreads, sizeof(*ctxs));
+    if (!accs || !ctxs)
+    {
+        perror("calloc");
+        free(accs);
+        free(ctxs);
+        return 1;
+    }
+    for (int i = 0; i < nthreads; ++i) ctxs[i] = &accs[i];
+
+    walk_tree_parallel(dirs, ndirs, nthreads, summary_visit, ctxs);
+
+    /* fold every worker's counts into the first accumulator */
+    struct summary_acc *res = &accs[0];
+    for (int i = 1; i < nthreads; ++i)
+    {
+        for (int c = 0; c < CLS_COUNT; ++c)
+        {
+            res->class_files[c] += accs[i].class_files[c];
+            res->class_bytes[c] += accs[i].class_bytes[c];
+        }
+        for (int b = 0; b < SUM_HIST_BUCKETS; ++b)
+        {
+            res->hist_files[b] += accs[i].hist_files[b];
+            res->hist_bytes[b] += accs[i].hist_bytes[b];
+        }
+        summary_merge_map(&res->owners, &accs[i].owners);
+        summary_merge_map(&res->groups, &accs[i].groups);
+        summary_merge_map(&res->exts, &accs[i].exts);
+        sum_map_free(&accs[i].owners);
+        sum_map_free(&accs[i].groups);
+        sum_map_free(&accs[i].exts);
+    }
+
+    summary_print(res);
+
+    sum_map_free(&res->owners);
+    sum_map_free(&res->groups);
+    sum_map_free(&res->exts);
+    free(accs);
+    free(ctxs);
+    return 0;
+}
+
+/* ---------- duplicate finder ---------- */
+
+/*
+ * --duplicates: the walker collects (size, dev, ino, path) of every
+ * non-empty regular file into per-worker lists. Candidates are then
+ * narrowed in rounds, each one a sort plus a filter that keeps only
+ * groups with at least two distinct inodes (hardlinks share an inode and
+ * are never hashed twice):
+ *   1. same size: a file with a unique size is never opened
+ *   2. same XXH64 of the first and last DUP_EDGE bytes
+ *   3. same XXH64 of the whole content (via the --checksum cache)
+ * Hashing runs on a thread pool, one job per distinct inode.
+ */
+
+#define DUP_EDGE       4096
+#define DUP_ARENA_SIZE (1024 * 1024)
+
+struct dup_rec
+{
+    uint64_t size;
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime_ns;
+    uint64_t hash;               /* edge hash, then full hash */
+    int failed;
+    char *path;                  /* in a worker arena */
+};
+
+/* path storage: paths are never freed one by one */
+struct dup_arena
+{
+    struct dup_arena *next;
+    size_t used;
+    char data[DUP_ARENA_SIZE];
+};
+
+struct dup_list
+{
+    struct dup_rec *v;
+    size_t count, cap;
+    struct dup_arena *arena;
+};
+
+static char *dup_arena_strdup(struct dup_list *l, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    if (!l->arena || l->arena->used + len > DUP_ARENA_SIZE)
+    {
+        struct dup_arena *a = malloc(sizeof(*a));
+        if (!a) return NULL;
+        a->next = l->arena;
+        a->used = 0;
+        l->arena = a;
+    }
+    char *p = l->arena->data + l->arena->used;
+    memcpy(p, s, len);
+    l->arena->used += len;
+    return p;
+}
+
+static void dup_visit(void *ctx, const char *path, const char *name, const struct stat *st)
+{
+    struct dup_list *l = ctx;
+    (void)name;
+    if (!S_ISREG(st->st_mode) || st->st_size == 0) return;
+    if (l->count >= l->cap)
+    {
+        size_t cap = l->cap ? l->cap * 2 : 1024;
+        struct dup_rec *v = realloc(l->v, cap * sizeof(*v));
+        if (!v) return;
+        l->v = v;
+        l->cap = cap;
+    }
+    char *p = dup_arena_strdup(l, path);
+    if (!p) return;
+    struct dup_rec *r = &l->v[l->count++];
+    r->size = (uint64_t)st->st_size;
+    r->dev = st->st_dev;
+    r->ino = st->st_ino;
+    r->mtime_ns = stat_mtime_ns(st);
+    r->hash = 0;
+    r->failed = 0;
+    r->path = p;
+}
+
+/* largest first, then by hash; one inode's links end up adjacent */
+static int cmp_dup_rec(const void *a, const void *b)
+{
+    const struct dup_rec *x = a, *y = b;
+    if (x->size != y->size) return x->size > y->size ? -1 : 1;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+static int dup_same_group(const struct dup_rec *a, const struct dup_rec *b)
+{
+    return a->size == b->size && a->hash == b->hash;
+}
+
+/*
+ * drop failed records, sort, then keep only groups (equal size and hash)
+ * with two or more distinct inodes. Returns the new count.
+ */
+static size_t dup_filter(struct dup_rec *v, size_t n)
+{
+    size_t out = 0, i = 0;
+    for (size_t k = 0; k < n; ++k)
+        if (!v[k].failed) v[out++] = v[k];
+    n = out;
+    out = 0;
+    parallel_merge_sort(v, n, sizeof(*v), cmp_dup_rec);
+    while (i < n)
+    {
+        size_t j = i + 1, inodes = 1;
+        for (; j < n && dup_same_group(&v[i], &v[j]); ++j)
+            if (v[j].dev != v[j - 1].dev || v[j].ino != v[j - 1].ino) inodes++;
+        if (inodes >= 2)
+        {
+            memmove(&v[out], &v[i], (j - i) * sizeof(*v));
+            out += j - i;
+        }
+        i = j;
+    }
+    return out;
+}
+
+/* XXH64 of the first and last DUP_EDGE bytes (the whole file if that covers it) */
+static int hash_file_edges(const struct dup_rec *r, uint64_t *out)
+{
+    int fd = open(r->path, O_RDONLY | O_NOCTTY);
+    if (fd == -1) return -1;
+    struct stat fst;
+    if (fstat(fd, &fst) == -1 || fst.st_dev != r->dev || fst.st_ino != r->ino ||
+        (uint64_t)fst.st_size != r->size)
+    {
+        close(fd);
+        return -1;
+    }
+    unsigned char buf[2 * DUP_EDGE];
+    size_t len = r->size <= sizeof(buf) ? (size_t)r->size : DUP_EDGE;
+    int ok = pread(fd, buf, len, 0) == (ssize_t)len;
+    if (ok && r->size > sizeof(buf))
+    {
+        ok = pread(fd, buf + DUP_EDGE, DUP_EDGE, (off_t)(r->size - DUP_EDGE)) == DUP_EDGE;
+        len += DUP_EDGE;
+    }
+    close(fd);
+    if (!ok) return -1;
+
+    struct xxh64_state s;
+    xxh64_init(&s);
+    xxh64_update(&s, buf, len);
+    *out = xxh64_digest(&s);
+    return 0;
+}
+
+/* full content hash, from the --checksum cache when still valid */
+static int hash_file_full(const struct dup_rec *r, uint64_t *out)
+{
+    pthread_mutex_lock(&hash_cache_lock);
+    if (!hash_cache_loaded) hash_cache_load();
+    if (hash_cache_cap > 0)
+    {
+        const struct hash_cache_rec *c = &hash_cache[hash_cache_slot(hash_cache, hash_cache_cap, r->dev, r->ino)];
+        if (c->ino != 0 && (uint64_t)c->size == r->size && c->mtime_ns == r->mtime_ns)
+        {
+            *out = c->hash;
+            pthread_mutex_unlock(&hash_cache_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&hash_cache_lock);
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_dev = r->dev;
+    st.st_ino = r->ino;
+    if (hash_file(AT_FDCWD, r->path, &st, out) != 0) return -1;
+
+    struct hash_cache_rec c = { r->dev, r->ino, (int64_t)r->size, r->mtime_ns, *out };
+    pthread_mutex_lock(&hash_cache_lock);
+    hash_cache_put(&c);
+    hash_cache_dirty = 1;
+    pthread_mutex_unlock(&hash_cache_lock);
+    return 0;
+}
+
+struct dup_job
+{
+    struct dup_rec *v;
+    size_t *reps;                /* first record of each distinct inode */
+    size_t n;
+    size_t next;                 /* atomically claimed */
+    int full;
+};
+
+static void *dup_hash_worker(void *arg)
+{
+    struct dup_job *job = arg;
+    size_t k;
+    while ((k = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n)
+    {
+        struct dup_rec *r = &job->v[job->reps[k]];
+        uint64_t h;
+        /* small files: the edge hash already covered every byte */
+        if (job->full && r->size <= 2 * DUP_EDGE) continue;
+        int rc = job->full ? hash_file_full(r, &h) : hash_file_edges(r, &h);
+        if (rc == 0) r->hash = h;
+        else r->failed = 1;
+    }
+    return NULL;
+}
+
+/* hash one record per distinct inode on a pool, then copy it to its links */
+static void dup_hash_round(struct dup_rec *v, size_t n, int full)
+{
+    size_t *reps = malloc((n ? n : 1) * sizeof(*reps));
+    if (!reps)
+    {
+        for (size_t i = 0; i < n; ++i) v[i].failed = 1;
+        return;
+    }
+    struct dup_job job = { v, reps, 0, 0, full };
+    for (size_t i = 0; i < n; ++i)
+        if (i == 0 || v[i].dev != v[i - 1].dev || v[i].ino != v[i - 1].ino) reps[job.n++] = i;
+
+    int nthreads = default_thread_count();
+    if ((size_t)nthreads > job.n) nthreads = job.n ? (int)job.n : 1;
+    pthread_t tids[64];
+    int started = 0;
+    for (int i = 1; i < nthreads; ++i)
+    {
+        if (pthread_create(&tids[started], NULL, dup_hash_worker, &job) != 0) break;
+        started++;
+    }
+    dup_hash_worker(&job);
+    for (int i = 0; i < started; ++i) pthread_join(tids[i], NULL);
+
+    for (size_t i = 1; i < n; ++i)
+        if (v[i].dev == v[i - 1].dev && v[i].ino == v[i - 1].ino)
+        {
+            v[i].hash = v[i - 1].hash;
+            v[i].failed = v[i - 1].failed;
+        }
+    free(reps);
+}
+
+static void dup_print(const struct dup_rec *v, size_t n)
+{
+    size_t i = 0, groups = 0;
+    while (i < n && !scan_stopped())
+    {
+        size_t j = i + 1, inodes = 1;
+        for (; j < n && dup_same_group(&v[i], &v[j]); ++j)
+            if (v[j].dev != v[j - 1].dev || v[j].ino != v[j - 1].ino) inodes++;
+        if (groups++ > 0) fputc('\n', out_fp);
+        fprintf(out_fp, "%llu bytes, %zu copies [%016llx]:\n",
+                (unsigned long long)v[i].size, inodes, (unsigned long long)v[i].hash);
+        for (size_t k = i; k < j; ++k)
+        {
+            /* further links of the inode printed just before */
+            if (k > i && v[k].dev == v[k - 1].dev && v[k].ino == v[k - 1].ino)
+                fprintf(out_fp, "  %s  (hardlink)\n", v[k].path);
+            else fprintf(out_fp, "  %s\n", v[k].path);
+        }
+        check_output();
+        i = j;
+    }
+}
+
+static int run_duplicates(char **dirs, size_t ndirs)
+{
+    int nthreads = default_thread_count();
+    struct dup_list *lists = calloc((size_t)nthreads, sizeof(*lists));
+    void **ctxs = calloc((size_t)nthreads, sizeof(*ctxs));
+    if (!lists || !ctxs)
+    {
+        perror("calloc");
+        free(lists);
+        free(ctxs);
+        return 1;
+    }
+    for (int i = 0; i < nthreads; ++i) ctxs[i] = &lists[i];
+
+    walk_tree_parallel(dirs, ndirs, nthreads, dup_visit, ctxs);
+
+    /* one array of every candidate; the paths stay in the worker arenas */
+    size_t n = 0;
+    for (int i = 0; i < nthreads; ++i) n += lists[i].count;
+    struct dup_rec *v = malloc((n ? n : 1) * sizeof(*v));
+    if (!v) { perror("malloc"); return 1; }
+    n = 0;
+    for (int i = 0; i < nthreads; ++i)
+    {
+        memcpy(v + n, lists[i].v, lists[i].count * sizeof(*v));
+        n += lists[i].count;
+        free(lists[i].v);
+    }
+
+    n = dup_filter(v, n);                  /* same size */
+    dup_hash_round(v, n, 0);
+    n = dup_filter(v, n);                  /* same edges */
+    dup_hash_round(v, n, 1);
+    n = dup_filter(v, n);                  /* same content */
+    dup_print(v, n);
+
+    hash_cache_save();
+    free(v);
+    for (int i = 0; i < nthreads; ++i)
+    {
+        struct dup_arena *a = lists[i].arena, *next;
+        for (; a; a = next) { next = a->next; free(a); }
+    }
+    free(lists);
+    free(ctxs);
+    return 0;
+}
+
+/* ---------- snapshots and diff ---------- */
+
+/*
+ * A snapshot is the recursive listing of one tree as a stream of records
+ * in component-wise path order (children sorted bytewise, each directory
+ * directly followed by its subtree). Format, after SNAP_MAGIC:
+ *   varint shared   bytes of the path shared with the previous record
+ *   varint len      length of the rest, followed by those bytes
+ *   byte   type     (mode & S_IFMT) >> 12
+ *   varint perm     mode & 07777
+ *   varint size, varint ino, varint zigzag(mtime in ns)
+ * Paths are relative to the snapshot root. Both a snapshot file and a
+ * live tree are read through the same cursor interface, so --diff is one
+ * merge-join pass whose memory is bounded by the directory depth.
+ */
+
+#define SNAP_MAGIC "LSSNAP\0\1"
+#define SNAP_MAGIC_LEN 8
+
+struct snap_rec
+{
+    char path[PATH_MAX];         /* relative to the root */
+    size_t len;
+    unsigned type;
+    unsigned perm;
+    uint64_t size, ino;
+    int64_t mtime_ns;
+};
+
+/* one open directory of a live tree cursor */
+struct snap_frame
+{
+    struct entry_table t;
+    uint32_t *order;             /* bytewise name order */
+    size_t next;
+    size_t path_len;             /* length of the directory's full path */
+    size_t rel_len;              /* and of its path below the root */
+    struct ignore_node *ign;
+};
+
+struct snap_cursor
+{
+    /* snapshot file */
+    FILE *fp;
+    /* live tree */
+    struct snap_frame *frames;
+    size_t depth, cap;
+    char full[PATH_MAX];         /* root + "/" + relative path */
+    size_t root_len;
+    dev_t root_dev;
+    struct visited_set *seen;    /* -L */
+    struct snap_rec rec;
+    int error;
+};
+
+static void snap_put_varint(FILE *fp, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        putc((int)(v & 0x7F) | 0x80, fp);
+        v >>= 7;
+    }
+    putc((int)v, fp);
+}
+
+/* 0 on success, -1 at a clean end of file, -2 on a truncated value */
+static int snap_get_varint(FILE *fp, uint64_t *v)
+{
+    uint64_t r = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int c = getc(fp);
+        if (c == EOF) return shift == 0 ? -1 : -2;
+        r |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+        {
+            *v = r;
+            return 0;
+        }
+    }
+    return -2;
+}
+
+/* compare paths component by component: '/' sorts before every other byte */
+static int snap_path_cmp(const char *a, const char *b)
+{
+    for (;; ++a, ++b)
+    {
+        unsigned char x = (unsigned char)*a, y = (unsigned char)*b;
+        if (x == y)
+        {
+            if (x == '\0') return 0;
+            continue;
+        }
+        if (x == '\0') return -1;
+        if (y == '\0') return 1;
+        if (x == '/') return -1;
+        if (y == '/') return 1;
+        return x < y ? -1 : 1;
+    }
+}
+
+static int cmp_name_bytes(const void *a, const void *b)
+{
+    return strcmp(((const struct name_rec *)a)->name, ((const struct name_rec *)b)->name);
+}
+
+/* read, stat and order the directory at c->full; 0 on success */
+static int snap_push_dir(struct snap_cursor *c, size_t path_len, size_t rel_len)
+{
+    if (c->depth >= c->cap)
+    {
+        size_t cap = c->cap ? c->cap * 2 : 16;
+        struct snap_frame *f = realloc(c->frames, cap * sizeof(*f));
+        if (!f) return -1;
+        c->frames = f;
+        c->cap = cap;
+    }
+    struct snap_frame *f = &c->frames[c->depth];
+    memset(f, 0, sizeof(*f));
+    struct ignore_node *parent = c->depth > 0 ? c->frames[c->depth - 1].ign : NULL;
+    if (exclude_count > 0 || use_gitignore) f->ign = ignore_enter(c->full, parent);
+    if (read_dir_entries(c->full, &f->t, f->ign) == -1)
+    {
+        fprintf(stderr, "Cannot open or read directory: %s\n", c->full);
+        ignore_unref(f->ign);
+        return -1;
+    }
+    if (f->t.count > 0) stat_entries(c->full, &f->t);
+
+    f->order = malloc((f->t.count ? f->t.count : 1) * sizeof(*f->order));
+    struct name_rec *nrec = malloc((f->t.count ? f->t.count : 1) * sizeof(*nrec));
+    if (!f->order || !nrec || (f->t.count > 0 && !f->t.st))
+    {
+        free(nrec);
+        free(f->order);
+        table_free(&f->t);
+        ignore_unref(f->ign);
+        return -1;
+    }
+    for (size_t i = 0; i < f->t.count; ++i) { nrec[i].name = ENT_NAME(&f->t, i); nrec[i].idx = (uint32_t)i; }
+    parallel_merge_sort(nrec, f->t.count, sizeof(*nrec), cmp_name_bytes);
+    for (size_t i = 0; i < f->t.count; ++i) f->order[i] = nrec[i].idx;
+    free(nrec);
+
+    f->path_len = path_len;
+    f->rel_len = rel_len;
+    c->depth++;
+    return 0;
+}
+
+static void snap_pop_dir(struct snap_cursor *c)
+{
+    struct snap_frame *f = &c->frames[--c->depth];
+    if (c->depth > 0) c->full[c->frames[c->depth - 1].path_len] = '\0';
+    free(f->order);
+    table_free(&f->t);
+    ignore_unref(f->ign);
+}
+
+/* open a cursor on a snapshot file or, if path is a directory, on a live tree */
+static int snap_open(struct snap_cursor *c, const char *path)
+{
+    memset(c, 0, sizeof(*c));
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        size_t len = strlen(path);
+        if (len >= sizeof(c->full)) return -1;
+        memcpy(c->full, path, len + 1);
+        c->root_len = len;
+        c->root_dev = st.st_dev;
+        if (follow_links && (c->seen = visited_new()) != NULL) visited_insert(c->seen, st.st_dev, st.st_ino);
+        return snap_push_dir(c, len, 0);
+    }
+    c->fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!c->fp) return -1;
+    char magic[SNAP_MAGIC_LEN];
+    if (fread(magic, 1, sizeof(magic), c->fp) != sizeof(magic) || memcmp(magic, SNAP_MAGIC, sizeof(magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a snapshot file\n", path);
+        if (c->fp != stdin) fclose(c->fp);
+        c->fp = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void snap_close(struct snap_cursor *c)
+{
+    if (c->fp && c->fp != stdin) fclose(c->fp);
+    while (c->depth > 0) snap_pop_dir(c);
+    free(c->frames);
+    visited_free(c->seen);
+}
+
+static const struct snap_rec *snap_next_file(struct snap_cursor *c)
+{
+    struct snap_rec *r = &c->rec;
+    uint64_t shared, len, type, perm, mt;
+    int rc = snap_get_varint(c->fp, &shared);
+    if (rc == -1) return NULL;
+    if (rc != 0 || snap_get_varint(c->fp, &len) != 0 || shared > r->len ||
+        shared + len >= sizeof(r->path) || fread(r->path + shared, 1, len, c->fp) != len)
+    {
+        c->error = 1;
+        return NULL;
+    }
+    r->len = shared + len;
+    r->path[r->len] = '\0';
+    if ((type = getc(c->fp)) == (uint64_t)EOF || snap_get_varint(c->fp, &perm) != 0 ||
+        snap_get_varint(c->fp, &r->size) != 0 || snap_get_varint(c->fp, &r->ino) != 0 ||
+        snap_get_varint(c->fp, &mt) != 0)
+    {
+        c->error = 1;
+        return NULL;
+    }
+    r->type = (unsigned)type;
+    r->perm = (unsigned)perm;
+    r->mtime_ns = (int64_t)(mt >> 1) ^ -(int64_t)(mt & 1);
+    return r;
+}
+
+static const struct snap_rec *snap_next_tree(struct snap_cursor *c)
+{
+    struct snap_rec *r = &c->rec;
+    while (c->depth > 0 && !scan_stopped())
+    {
+        struct snap_frame *f = &c->frames[c->depth - 1];
+        if (f->next >= f->t.count)
+        {
+            snap_pop_dir(c);
+            continue;
+        }
+        size_t i = f->order[f->next++];
+        if (!f->t.has_stat[i]) continue;
+        const char *name = ENT_NAME(&f->t, i);
+        size_t nlen = f->t.name_len[i];
+        if (f->path_len + 1 + nlen >= sizeof(c->full) || f->rel_len + 1 + nlen >= sizeof(r->path))
+            continue; /* path too long, skip */
+
+        const struct stat *st = &f->t.st[i];
+        size_t rel = f->rel_len;
+        if (rel > 0) r->path[rel++] = '/';
+        memcpy(r->path + rel, name, nlen + 1);
+        r->len = rel + nlen;
+        r->type = (st->st_mode & S_IFMT) >> 12;
+        r->perm = st->st_mode & 07777;
+        r->size = (uint64_t)st->st_size;
+        r->ino = (uint64_t)st->st_ino;
+        r->mtime_ns = stat_mtime_ns(st);
+
+        /* descend right away: the subtree follows its directory */
+        if (S_ISDIR(st->st_mode) && !prune_dir(st, c->root_dev) &&
+            (!c->seen || visited_insert(c->seen, st->st_dev, st->st_ino) != 0))
+        {
+            /* c->full stays the path of the innermost open directory */
+            size_t dir_len = f->path_len, plen = dir_len;
+            c->full[plen++] = '/';
+            memcpy(c->full + plen, name, nlen + 1);
+            if (snap_push_dir(c, plen + nlen, r->len) == -1) c->full[dir_len] = '\0';
+        }
+        return r;
+    }
+    return NULL;
+}
+
+static const struct snap_rec *snap_next(struct snap_cursor *c)
+{
+    return c->fp ? snap_next_file(c) : snap_next_tree(c);
+}
+
+/* --snapshot=FILE: write the tree under dir */
+static int run_snapshot(const char *dir, const char *file)
+{
+    struct snap_cursor c;
+    struct stat st;
+    memset(&c, 0, sizeof(c));
+    if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode) || snap_open(&c, dir) == -1)
+    {
+        fprintf(stderr, "Cannot open or read directory: %s\n", dir);
+        snap_close(&c);
+        return 1;
+    }
+    FILE *fp = strcmp(file, "-") == 0 ? stdout : fopen(file, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Cannot create snapshot: %s: %s\n", file, strerror(errno));
+        snap_close(&c);
+        return 1;
+    }
+
+    fwrite(SNAP_MAGIC, 1, SNAP_MAGIC_LEN, fp);
+    char prev[PATH_MAX];
+    size_t prev_len = 0;
+    const struct snap_rec *r;
+    while ((r = snap_next(&c)) != NULL)
+    {
+        size_t shared = 0;
+        while (shared < prev_len && shared < r->len && prev[shared] == r->path[shared]) shared++;
+        snap_put_varint(fp, shared);
+        snap_put_varint(fp, r->len - shared);
+        fwrite(r->path + shared, 1, r->len - shared, fp);
+        putc((int)r->type, fp);
+        snap_put_varint(fp, r->perm);
+        snap_put_varint(fp, r->size);
+        snap_put_varint(fp, r->ino);
+        snap_put_varint(fp, ((uint64_t)r->mtime_ns << 1) ^ (uint64_t)(r->mtime_ns >> 63));
+        memcpy(prev, r->path, r->len + 1);
+        prev_len = r->len;
+        if (ferror(fp)) break;
+    }
+    snap_close(&c);
+
+    int rc = ferror(fp) ? 1 : 0;
+    if (fp != stdout && fclose(fp) != 0) rc = 1;
+    if (rc) fprintf(stderr, "Cannot write snapshot: %s\n", file);
+    return rc;
+}
+
+static void snap_print_change(const struct snap_rec *a, const struct snap_rec *b)
+{
+    char what[64] = "";
+    if (a->type != b->type) strcat(what, " type");
+    if (a->perm != b->perm) strcat(what, " mode");
+    if (a->size != b->size) strcat(what, " size");
+    if (a->mtime_ns != b->mtime_ns) strcat(what, " mtime");
+    if (a->ino != b->ino) strcat(what, " ino");
+    if (what[0]) fprintf(out_fp, "~ %s [%s]\n", b->path, what + 1);
+}
+
+/*
+ * --diff OLD NEW: merge-join two cursors. Each side is either a snapshot
+ * file or a directory. Exit status as diff(1): 0 same, 1 different, 2 trouble.
+ */
+static int run_diff(const char *old_path, const char *new_path)
+{
+    struct snap_cursor a, b;
+    if (snap_open(&a, old_path) == -1)
+    {
+        fprintf(stderr, "Cannot open snapshot or directory: %s\n", old_path);
+        snap_close(&a);
+        return 2;
+    }
+    if (snap_open(&b, new_path) == -1)
+    {
+        fprintf(stderr, "Cannot open snapshot or directory: %s\n", new_path);
+        snap_close(&a);
+        snap_close(&b);
+        return 2;
+    }
+
+    size_t changes = 0;
+    const struct snap_rec *x = snap_next(&a), *y = snap_next(&b);
+    while ((x || y) && !scan_stopped())
+    {
+        int c = !x ? 1 : !y ? -1 : snap_path_cmp(x->path, y->path);
+        if (c < 0)
+        {
+            fprintf(out_fp, "- %s\n", x->path);
+            changes++;
+            x = snap_next(&a);
+        }
+        else if (c > 0)
+        {
+            fprintf(out_fp, "+ %s\n", y->path);
+            changes++;
+            y = snap_next(&b);
+        }
+        else
+        {
+            if (x->type != y->type || x->perm != y->perm || x->size != y->size ||
+                x->mtime_ns != y->mtime_ns || x->ino != y->ino)
+            {
+                snap_print_change(x, y);
+                changes++;
+            }
+            x = snap_next(&a);
+            y = snap_next(&b);
+        }
+        check_output();
+    }
+
+    int rc = changes > 0;
+    if (a.error || b.error)
+    {
+        fprintf(stderr, "Truncated or corrupt snapshot: %s\n", a.error ? old_path : new_path);
+        rc = 2;
+    }
+    snap_close(&a);
+    snap_close(&b);
+    return rc;
+}
+
+/* ---------- operand sources ---------- */
+
+/*
+ * Next operand as a malloc'ed string, NULL at the end. A --from-file
+ * stream is split on NUL or newline: the first separator seen decides,
+ * and NUL always separates since no path can contain it. Empty records
+ * are skipped.
+ */
+static char *operand_next(struct operand_source *src)
+{
+    if (!src->fp) return src->pos < src->argc ? strdup(src->argv[src->pos++]) : NULL;
+
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    int c;
+    for (;;)
+    {
+        c = getc(src->fp);
+        if (c == EOF || c == '\0' || (c == '\n' && src->sep != '\0'))
+        {
+            if (c != EOF && src->sep < 0) src->sep = c;
+            if (len > 0 || c == EOF) break;
+            continue;
+        }
+        if (len + 1 >= cap)
+        {
+            cap = cap ? cap * 2 : 256;
+            char *nb = realloc(buf, cap);
+            if (!nb)
+            {
+                free(buf);
+                return NULL;
+            }
+            buf = nb;
+        }
+        buf[len++] = (char)c;
+    }
+    if (len == 0) return NULL;
+    buf[len] = '\0';
+    return buf;
+}
+
+/* read every remaining operand into an array (for modes that need them all) */
+static char **operand_collect(struct operand_source *src, size_t *n)
+{
+    char **v = NULL;
+    size_t cap = 0;
+    char *dir;
+    *n = 0;
+    while ((dir = operand_next(src)) != NULL)
+    {
+        if (*n >= cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            char **nv = realloc(v, cap * sizeof(*v));
+            if (!nv)
+            {
+                free(dir);
+                for (size_t i = 0; i < *n; ++i) free(v[i]);
+                free(v);
+                return NULL;
+            }
+            v = nv;
+        }
+        v[(*n)++] = dir;
+    }
+    if (*n == 0) v = malloc(sizeof(*v));
+    return v;
+}
+
+/* ---------- concurrent operands ---------- */
+
+/*
+ * Workers claim operands in order and render each one into a memstream
+ * buffer (out_fp is thread-local). The main thread waits for operand i,
+ * writes it out, frees it and moves on; a worker never runs more than
+ * OPERAND_WINDOW operands ahead of the printer, which bounds memory.
+ * Error messages still go straight to stderr.
+ *
+ * Operands are pulled from the source one at a time under src_lock, so a
+ * --from-file stream is consumed as it arrives; a worker blocked reading
+ * it holds src_lock only, never the lock the printer needs.
+ */
+
+struct operand_slot
+{
+    char *buf;
+    size_t len;
+    int done;
+};
+
+struct operand_pipeline
+{
+    pthread_mutex_t src_lock;    /* serializes operand_next() */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct operand_source *src;
+    size_t next;                 /* next operand to claim */
+    size_t printed;              /* operands already written */
+    int exhausted;               /* source drained or scan stopped; next is final */
+    display_mode_t mode;
+    int recursive;
+    struct operand_slot slots[OPERAND_WINDOW];
+};
+
+static void *operand_worker(void *arg)
+{
+    struct operand_pipeline *p = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&p->src_lock);
+        pthread_mutex_lock(&p->lock);
+        while (!p->exhausted && p->next >= p->printed + OPERAND_WINDOW && !scan_stopped())
+            pthread_cond_wait(&p->cond, &p->lock);
+        int stop = p->exhausted || scan_stopped();
+        pthread_mutex_unlock(&p->lock);
+
+        char *dir = stop ? NULL : operand_next(p->src);
+        pthread_mutex_lock(&p->lock);
+        if (!dir)
+        {
+            p->exhausted = 1;
+            pthread_cond_broadcast(&p->cond);
+            pthread_mutex_unlock(&p->lock);
+            pthread_mutex_unlock(&p->src_lock);
+            break;
+        }
+        size_t seq = p->next++;
+        pthread_mutex_unlock(&p->lock);
+        pthread_mutex_unlock(&p->src_lock);
+
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *mem = open_memstream(&buf, &len);
+        if (mem)
+        {
+            out_fp = mem;
+            process_dir_recursive(dir, p->mode, p->recursive);
+            fclose(mem);
+        }
+        else fprintf(stderr, "Cannot buffer output for: %s\n", dir);
+        free(dir);
+
+        pthread_mutex_lock(&p->lock);
+        struct operand_slot *slot = &p->slots[seq % OPERAND_WINDOW];
+        slot->buf = buf;
+        slot->len = len;
+        slot->done = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+/* returns -1 if no worker could be started (caller then runs sequentially) */
+static int run_operands_concurrent(struct operand_source *src, display_mode_t mode, int recursive)
+{
+    struct operand_pipeline p;
+    memset(&p, 0, sizeof(p));
+    pthread_mutex_init(&p.src_lock, NULL);
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    p.src = src;
+    p.mode = mode;
+    p.recursive = recursive;
+
+    int nthreads = default_thread_count();
+    if (nthreads < OPERAND_THREADS_MIN) nthreads = OPERAND_THREADS_MIN;
+    if (!src->fp && (size_t)nthreads > src->argc) nthreads = (int)src->argc;
+
+    pthread_t tids[OPERAND_WINDOW];
+    int started = 0;
+    for (int i = 0; i < nthreads && i < OPERAND_WINDOW; ++i)
+    {
+        if (pthread_create(&tids[i], NULL, operand_worker, &p) != 0) break;
+        started++;
+    }
+    if (started == 0)
+    {
+        pthread_cond_destroy(&p.cond);
+        pthread_mutex_destroy(&p.lock);
+        pthread_mutex_destroy(&p.src_lock);
+        return -1;
+    }
+
+    for (size_t seq = 0; ; ++seq)
+    {
+        struct operand_slot *slot = &p.slots[seq % OPERAND_WINDOW];
+        pthread_mutex_lock(&p.lock);
+        while (!slot->done && !(p.exhausted && seq >= p.next))
+            pthread_cond_wait(&p.cond, &p.lock);
+        if (!slot->done)
+        {
+            pthread_mutex_unlock(&p.lock);
+            break;
+        }
+        char *buf = slot->buf;
+        size_t len = slot->len;
+        slot->buf = NULL;
+        slot->done = 0;
+        pthread_mutex_unlock(&p.lock);
+
+        if (seq > 0) fputc('\n', stdout);
+        if (buf) fwrite(buf, 1, len, stdout);
+        free(buf);
+        /* a stream of operands may be open-ended: hand each listing on now */
+        if (src->fp) fflush(stdout);
+        check_output();
+
+        pthread_mutex_lock(&p.lock);
+        p.printed++;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+        if (scan_stopped()) break;
+    }
+
+    for (int i = 0; i < started; ++i) pthread_join(tids[i], NULL);
+    /* buffers rendered but never printed (output was cancelled) */
+    for (size_t i = 0; i < OPERAND_WINDOW; ++i) free(p.slots[i].buf);
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+    pthread_mutex_destroy(&p.src_lock);
+    return 0;
+}